@@ -0,0 +1,47 @@
+#!/usr/bin/python
+"""
+generateBeamCodebook.py
+ 
+  Usage demonstration of calling the functions in the KDK row and column
+  driver shared library, after loading it dynamically.
+  
+  Generates a beam codebook file holding the packed pattern of every point
+  of a theta, phi, phase grid.  Does not touch the FPGA, so it may be run
+  off-target against a host build of the library, then the file is copied
+  to the board and opened with openBeamCodebook().
+
+  usage:  python generateBeamCodebook.py <codebook file> [library path]
+ 
+"""
+
+from ctypes import *
+import ctypes
+import sys
+
+libPath = '/opt/kymeta/lib/libRowAndColDriver.so'
+if len(sys.argv) > 2:
+    libPath = sys.argv[2]
+if len(sys.argv) < 2:
+    print "usage:  python generateBeamCodebook.py <codebook file> [library path]"
+    sys.exit(1)
+
+rowAndColDriverLib = cdll.LoadLibrary(libPath)
+print "library loaded"
+
+rowAndColDriverLib.writeBeamCodebook.argtypes = [c_char_p,
+    c_double, c_double, c_uint32,
+    c_double, c_double, c_uint32,
+    c_double, c_double, c_uint32]
+
+# theta 0 to 60 degrees in 1 degree steps, phi all the way around in 2 degree
+# steps, a single phase
+print "generating beam codebook..."
+rtnValue = rowAndColDriverLib.writeBeamCodebook(sys.argv[1],
+    0.0, 1.0, 61,
+    0.0, 2.0, 180,
+    0.0, 0.0, 1)
+if rtnValue == 0:
+    print "beam codebook written to", sys.argv[1]
+else:
+    print "beam codebook generation failed..."
+    sys.exit(1)
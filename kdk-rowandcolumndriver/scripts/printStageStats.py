@@ -0,0 +1,89 @@
+#!/usr/bin/python
+"""
+printStageStats.py
+ 
+  Usage demonstration of calling the functions in the KDK row and column
+  driver shared library, after loading it dynamically.
+  
+  Times every stage of a pattern update over a sweep of steering angles,
+  each pattern is steered, packed and committed through the bank double
+  buffer, then prints the min, mean, p99 and max latency of each stage.
+
+  usage:  python printStageStats.py [number of updates] [cycle counter MHz]
+ 
+"""
+
+from ctypes import *
+import ctypes
+import sys
+
+# latency stages, as numbered in rowAndColumnDriver.h
+stageNames = ["wave compute", "quantize", "pack", "upload", "bank swap",
+              "irq wait"]
+
+class StageLatencyStats(Structure):
+    _fields_ = [("count", c_uint32),
+                ("minNs", c_uint32),
+                ("meanNs", c_uint32),
+                ("maxNs", c_uint32),
+                ("p99Ns", c_uint32)]
+
+numUpdates = 1000
+if len(sys.argv) > 1:
+    numUpdates = int(sys.argv[1])
+
+rowAndColDriverLib = cdll.LoadLibrary('/opt/kymeta/lib/libRowAndColDriver.so')
+print "library loaded"
+
+rowAndColDriverLib.steerAndPack.argtypes = [c_double, c_double, c_double,
+    POINTER(c_uint32)]
+rowAndColDriverLib.getStageStats.argtypes = [c_int,
+    POINTER(StageLatencyStats)]
+
+print "mapping memory"
+pathName = "/dev/aperture-control"
+rtnValue = rowAndColDriverLib.openAndMapFpgaMemory(pathName)
+if rtnValue == 0:
+    print "map memory function call successful..."
+else:
+    print "map memory function call failed..."
+    sys.exit(1)
+
+if len(sys.argv) > 2:
+    rtnValue = rowAndColDriverLib.setStageTiming("cycle counter",
+                                                 int(sys.argv[2]))
+else:
+    rtnValue = rowAndColDriverLib.setStageTiming("monotonic", 0)
+if rtnValue != 0:
+    print "stage timing not available..."
+    sys.exit(1)
+rowAndColDriverLib.resetStageStats()
+
+print "steering and committing", numUpdates, "patterns..."
+packedPattern = (c_uint32 * 1050)()
+deltaWords = 0
+for update in range(numUpdates):
+    theta = (update % 61) * 1.0
+    rowAndColDriverLib.steerAndPack(theta, 0.0, 0.0, packedPattern)
+    if rowAndColDriverLib.commitPatternDoubleBuffered(packedPattern) != 0:
+        print "commit failed..."
+    deltaWords += rowAndColDriverLib.getLastDeltaWords()
+print "mean words written per commit: %.1f" % (deltaWords / float(numUpdates))
+
+stats = StageLatencyStats()
+print "%-14s %8s %10s %10s %10s %10s" % ("stage", "count", "min us",
+                                         "mean us", "p99 us", "max us")
+for stage in range(len(stageNames)):
+    rowAndColDriverLib.getStageStats(stage, byref(stats))
+    print "%-14s %8u %10.1f %10.1f %10.1f %10.1f" % (stageNames[stage],
+        stats.count, stats.minNs / 1000.0, stats.meanNs / 1000.0,
+        stats.p99Ns / 1000.0, stats.maxNs / 1000.0)
+
+rowAndColDriverLib.setStageTiming("off", 0)
+
+print "unmapping memory"
+rtnValue = rowAndColDriverLib.closeAndUnmapFpgaMemory()
+if rtnValue == 0:
+    print "munap memory function call successful..."
+else:
+    print "munap memory function call failed..."
@@ -28,6 +28,9 @@ from time import *
 rowAndColDriverLib = cdll.LoadLibrary('/opt/kymeta/lib/libRowAndColDriver.so')
 print "library loaded"
 
+# pattern presets, as numbered in rowAndColumnDriver.h
+PRESET_ALL_OFF = 0
+
 print "mapping memory"
 pathName = "/dev/aperture-control"
 rtnValue = rowAndColDriverLib.openAndMapFpgaMemory(pathName)
@@ -37,49 +40,15 @@ else:
     print "map memory function call failed..."
     sys.exit(0)
 
-print "populating modulation mask..."
-rowAndColDriverLib.populateModulationMask()
-
-sleep(1)
-    
-print "populating modulation matrix all off..."
-pattern = "all off"
-rowAndColDriverLib.populateModulationMatrix(pattern)
-
-sleep(1)
-
-print "\ntoggling hps bank select...\n"
-
-addressOffset = c_uint8(0)
-readValue = c_uint32(0)
-writeValue = c_uint32(0)
-
-# bank_sel_hps
-addressOffset = 36
-readValue = rowAndColDriverLib.readRegisterValue(addressOffset)
-writeValue = ~readValue
-rowAndColDriverLib.writeRegisterValue(addressOffset, writeValue)
-sleep(1)
-
-print "pending for irq assertion...\n"
-# conifer_isr
-addressOffset = 32
-readValue = rowAndColDriverLib.readRegisterValue(addressOffset)
-while readValue > 0:
-    sleep(1)
-    readValue = rowAndColDriverLib.readRegisterValue(addressOffset)
-
-print "writing formatted data to pattern buffer..."
-rowAndColDriverLib.formatAndWriteModulationToFPGAKDKFromScratch()
-sleep(1)
+# wait up to 10 s for the FPGA to release the bank, the library default of
+# 100 ms is meant for steering updates, not for bring-up
+commitTimeoutUs = 10000000
+rowAndColDriverLib.setPatternCommitTimeout(commitTimeoutUs)
 
-print "\ntoggling conifer bank select...\n"
-# bank_sel_conifer
-addressOffset = 40
-readValue = rowAndColDriverLib.readRegisterValue(addressOffset)
-writeValue = ~readValue
-rowAndColDriverLib.writeRegisterValue(addressOffset, writeValue)
-sleep(1)
+print "committing all off preset through the bank double buffer..."
+rtnValue = rowAndColDriverLib.commitPresetPattern(PRESET_ALL_OFF)
+if rtnValue != 0:
+    print "pattern commit failed, irq timeout or pattern readback mismatch..."
 
 print "unmapping memory"
 rtnValue = rowAndColDriverLib.closeAndUnmapFpgaMemory()
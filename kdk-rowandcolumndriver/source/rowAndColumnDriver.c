@@ -25,6 +25,11 @@
 #include "kdkRowAndColBitMap.h"
 #include "kdkActiveCellGeometry.h"
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define USE_NEON_KERNELS
+#endif
+
 static uint8_t 	modulationBuffer[MAX_ROWS * MAX_COLS];
 static uint8_t 	modulationInput[MAX_ROWS * MAX_COLS];
 static uint8_t 	modulationMask[MAX_ROWS * MAX_COLS];
@@ -33,11 +38,301 @@ static uint32_t zeroBuffer[BUF_SIZE];
 static double 	modulationReal[ACTV_CELLS];
 static uint32_t modulationWave[ACTV_CELLS];
 
+// per-cell wave equation terms that depend only on the active cell geometry
+// and the board constants, filled in once by initCellGeometry()
+static struct {
+	double waveInReal[ACTV_CELLS];	// cos(ks * rhoRound), rhoRound is the
+									// radial distance truncated to 0.1 mm
+	double waveInImag[ACTV_CELLS];	// sin(ks * rhoRound)
+	double rotCos[ACTV_CELLS];		// cos(kdkRotGeoVal)
+	double rotSin[ACTV_CELLS];		// sin(kdkRotGeoVal)
+} cellGeometry;
+static bool cellGeometryValid = false;
+static double kf;					// wave number in free space
+static double ks;					// wave number in the substrate
+static double polThetaMag;			// theta polarization weight
+static double polPhiMag;			// phi polarization weight
+static double polAngleDegrees;		// atan2(polPhiMag, polThetaMag), degrees
+
+// pattern buffer word and bit mask of every active cell, sorted by word so a
+// packing pass only visits active cells and writes the words in order,
+// filled in once by initCellPacking()
+typedef struct {
+	uint16_t word;
+	uint16_t cell;			// index into the active cell arrays
+	uint16_t matrixIndex;	// row * numCols + col in the modulation matrices
+	uint32_t mask;
+} cellPackEntry;
+static cellPackEntry cellPackTable[ACTV_CELLS];
+static bool cellPackTableValid = false;
+static uint8_t cellLevel[ACTV_CELLS];
+
+// packed diagnostic presets, built on first use
+static uint32_t presetPatterns[NUM_PATTERN_PRESETS][BUF_SIZE];
+static bool presetPatternValid[NUM_PATTERN_PRESETS];
+
+// single precision copy of the cached geometry used by the float32 kernel,
+// the incident wave is kept as its angle, ks * rhoRound reduced to +/- pi
+static struct {
+	float x[ACTV_CELLS];
+	float y[ACTV_CELLS];
+	float waveInAngle[ACTV_CELLS];
+	float rotCos[ACTV_CELLS];
+	float rotSin[ACTV_CELLS];
+} cellGeometryF32 __attribute__((aligned(16)));
+
+// fixed point copy of the cached geometry used by the fixed point kernel,
+// angles are unsigned fractions of a turn so reducing them modulo 2 pi is
+// plain 32 bit wraparound, positions are signed Q8.24 meters
+#define SINE_TABLE_BITS		12
+#define SINE_TABLE_SIZE		(1 << SINE_TABLE_BITS)
+static struct {
+	int32_t x[ACTV_CELLS];
+	int32_t y[ACTV_CELLS];
+	uint32_t waveInTurns[ACTV_CELLS];
+	uint32_t rotTurns[ACTV_CELLS];
+} cellGeometryFixed;
+static int16_t sineTableQ15[SINE_TABLE_SIZE];
+
+// steering terms shared by every cell for one pointing
+typedef struct {
+	double sinPhi;
+	double cosPhi;
+	double xScale;			// kf * sin(theta) * cos(phi)
+	double yScale;			// kf * sin(theta) * sin(phi)
+	double thetaMag;		// theta polarization weight
+	double phiMagCos;		// phi polarization weight * cos(phase)
+	double phiMagSin;		// phi polarization weight * sin(phase)
+	double phiTurns;		// phi as a fraction of a turn
+} steeringTerms;
+
+// a wave kernel fills modulationReal[] for cells first to last - 1 and
+// returns the largest magnitude it wrote
+typedef double (*waveKernel)(const steeringTerms* terms, uint16_t first,
+		uint16_t last);
+
+static double calcWaveKernelDouble(const steeringTerms* terms,
+		uint16_t first, uint16_t last);
+static waveKernel activeWaveKernel = calcWaveKernelDouble;
+
+// per-cell wave, waveIn * waveOut, and the phi terms of the last pointing,
+// kept so the phase and polarization can change without recomputing the
+// steering, the theta and phi components are the wave times eTheta and ePhi
+static struct {
+	double waveRe[ACTV_CELLS];
+	double waveIm[ACTV_CELLS];
+	double sinPhi;
+	double cosPhi;
+	bool valid;
+} lastPointing;
+
+// state of the incremental sweep, for a fixed phi and phase stepping
+// sin(theta) by a constant rotates each cell's outgoing wave by a constant
+// per-cell rotor, so a step is one complex multiply per cell
+#define DEFAULT_SWEEP_RESEED_INTERVAL	64
+static struct {
+	double waveRe[ACTV_CELLS];		// waveIn * waveOut at the current step
+	double waveIm[ACTV_CELLS];
+	double rotorRe[ACTV_CELLS];		// waveOut change per step
+	double rotorIm[ACTV_CELLS];
+	double weightRe[ACTV_CELLS];	// polarization weighted eTheta and ePhi
+	double weightIm[ACTV_CELLS];
+	steeringTerms terms;
+	double phase;					// radians, to reweight on a new polarization
+	double startSinTheta;
+	double sinThetaStep;
+	double seedSinTheta;
+	uint32_t stepCount;
+	uint16_t reseedInterval;
+	bool active;
+} waveSweep;
+
+// LRU cache of packed patterns keyed by the steering angles quantized to
+// patternCache.resolution, entries are chained in hash buckets and in a
+// doubly linked recency list, most recent at head
+#define PATTERN_CACHE_NONE	0xffffffff
+typedef struct {
+	int32_t key[3];
+	uint32_t prev;
+	uint32_t next;
+	uint32_t hashNext;
+	uint32_t pattern[BUF_SIZE];
+} patternCacheEntry;
+static struct {
+	patternCacheEntry* entries;
+	uint32_t* hashHeads;
+	uint32_t hashMask;
+	uint32_t numEntries;
+	uint32_t maxEntries;
+	uint32_t head;
+	uint32_t tail;
+	double resolution;
+	uint32_t hits;
+	uint32_t misses;
+} patternCache;
+
+// mapped beam codebook, see beamCodebookHeader
+static struct {
+	const beamCodebookHeader* header;
+	const uint32_t* patterns;
+	size_t mapSize;
+} beamCodebook;
+
+// pattern snapshot log being appended to, and the mapped log being read,
+// see patternSnapshotHeader
+static int fdSnapshot = -1;
+static float modulationSnapshot[ACTV_CELLS];
+static struct {
+	const uint8_t* map;
+	size_t mapSize;
+	size_t offset;
+} snapshotReader;
+
+// bank_sel_hps and time of the last write into pattern Ram, latched by the
+// upload so snapshots do not read the bank register or the clock
+static struct {
+	uint8_t bank;
+	uint64_t timestampNs;
+} patternWriteLatch;
+
+// background pattern recorder, a single producer single consumer ring of
+// snapshot records without modulation vector, the steering path fills slots
+// at head and the recorder thread writes them out from tail
+#define DEFAULT_RECORDER_SLOTS		256
+#define RECORDER_FLUSH_INTERVAL_US	20000
+#define RECORDER_NICE_VALUE			19
+typedef struct {
+	patternSnapshotHeader header;
+	uint32_t pattern[BUF_SIZE];
+} recorderSlot;
+static struct {
+	pthread_t thread;
+	recorderSlot* slots;
+	uint32_t slotMask;
+	uint32_t head;			// written by the producer only
+	uint32_t tail;			// written by the recorder thread only
+	uint32_t recorded;
+	uint32_t overruns;
+	int fd;
+	bool running;
+	bool stopping;
+} patternRecorder = { .fd = -1 };
+
+// persistent worker pool that splits the per-cell loops across the A9 cores,
+// the calling thread takes slice 0 and worker n takes slice n
+#define MAX_WAVE_WORKERS	3
+typedef void (*waveJob)(uint16_t first, uint16_t last, uint8_t slice);
+static struct {
+	pthread_t threads[MAX_WAVE_WORKERS];
+	pthread_mutex_t lock;
+	pthread_cond_t jobReady;
+	pthread_cond_t jobDone;
+	uint8_t numWorkers;
+	uint8_t pending;
+	uint32_t generation;
+	bool stopping;
+	waveJob job;
+	const steeringTerms* terms;			// input to the kernel job
+	double maxModVal;					// input to the quantize job
+	double partialMax[MAX_WAVE_WORKERS + 1];
+} wavePool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.jobReady = PTHREAD_COND_INITIALIZER,
+	.jobDone = PTHREAD_COND_INITIALIZER,
+};
+
+// pacing of pattern uploads, by default the whole pattern goes out as one
+// burst, see setPatternWritePacing()
+typedef enum {
+	PACING_NONE,
+	PACING_SLEEP,
+	PACING_SPIN
+} patternWritePacing;
+static patternWritePacing writePacing = PACING_NONE;
+static uint32_t wordsPerPause = BUF_SIZE;
+static uint32_t pauseNanoseconds = 0;
+
+// cached copy of what each pattern Ram bank holds, so uploads only need to
+// write the words that change, a bank's copy is dropped whenever pattern Ram
+// is written some other way
+static uint32_t bankShadow[2][BUF_SIZE] __attribute__((aligned(16)));
+static bool bankShadowValid[2] = { false, false };
+
+// longest wait for conifer_isr to clear during a bank swap
+#define DEFAULT_COMMIT_TIMEOUT_US	100000
+static uint32_t commitTimeoutUs = DEFAULT_COMMIT_TIMEOUT_US;
+static uint32_t lastDeltaWords = 0;	// words written by the last commit
+
+// conifer_isr waits spin this long before blocking on the interrupt, or
+// before falling back to sleeping between polls when there is none
+#define CONIFER_SPIN_NS			20000
+#define CONIFER_POLL_SLEEP_US	50
+static int fdConiferIrq = -1;		// UIO node of the FPGA interrupt
+
+// readback check of pattern Ram after a commit, a CRC32 of the staged
+// pattern against a CRC32 of what pattern Ram holds, see
+// setPatternVerify()
+#define CRC32_POLYNOMIAL	0xEDB88320u
+typedef enum {
+	VERIFY_OFF,
+	VERIFY_EVERY_COMMIT,
+	VERIFY_EVERY_N
+} patternVerifyMode;
+static patternVerifyMode verifyMode = VERIFY_EVERY_COMMIT;
+static uint32_t verifyInterval = 1;
+static uint32_t commitsSinceVerify = 0;
+static uint32_t crc32Table[256];
+static bool crc32TableValid = false;
+
+// debug output of the intermediate buffers, off by default so pattern
+// updates do no file I/O, see setTraceLevel()
+typedef enum {
+	TRACE_OFF,
+	TRACE_BINARY,
+	TRACE_CSV
+} traceLevel;
+static traceLevel activeTraceLevel = TRACE_OFF;
+static int fdTrace = -1;
+
+// CSV exports are formatted into one buffer, large enough for a whole
+// matrix, and written to exportDirectory, empty for the working directory
+#define EXPORT_BUFFER_SIZE	(MAX_ROWS * (MAX_COLS * 4 + 1))
+static char exportText[EXPORT_BUFFER_SIZE];
+static char exportDirectory[PATH_MAX];
+
+// per-stage latency, lifetime count, min, max and total plus a ring of the
+// latest samples for the percentile, off by default, see setStageTiming()
+#define LATENCY_SAMPLES		1024
+typedef enum {
+	STAGE_CLOCK_OFF,
+	STAGE_CLOCK_MONOTONIC,
+	STAGE_CLOCK_CYCLES
+} stageClockSource;
+static stageClockSource stageClock = STAGE_CLOCK_OFF;
+#if defined(__arm__)
+static uint32_t cyclesPerTick = 1;
+static uint32_t cpuClockMHz = 1;
+#endif
+static struct {
+	uint32_t samples[NUM_LATENCY_STAGES][LATENCY_SAMPLES];
+	uint32_t count[NUM_LATENCY_STAGES];
+	uint32_t minNs[NUM_LATENCY_STAGES];
+	uint32_t maxNs[NUM_LATENCY_STAGES];
+	uint64_t totalNs[NUM_LATENCY_STAGES];
+} stageLatency;
+
 // declare variables for use in mapping hardware registers into process space
 int 				fdFpgaReg;			// file descriptor for FPGA registers
 volatile uint8_t*	fpgaRegBaseAddrPtr;	// holds return value from mmap call
 uint32_t* 			patternBuffer;		// pointer to start of FPGA RAM
 
+// optional second mapping of the pattern Ram pages with write combining
+// attributes, patternBuffer points into it while it is open and the
+// control registers stay on the uncached mapping
+#define PATTERN_BURST_WORDS	16
+static uint32_t*	patternRamWriteCombined = NULL;
+static int			fdPatternRam = -1;
+
 /*****************************************************************************
 *
 * function printFPBufferToFile()
@@ -61,11 +356,88 @@ void printFPBufferToFile(double* buffer, char* filePath)
 	fclose (pFile);
 }
 
+/*****************************************************************************
+ *
+ * Set the directory CSV exports are written to, NULL or "" for the working
+ * directory.  Absolute file names are used as they are.
+ *
+ * Returns 0 on success, -1 if the path is not a directory.
+ *
+ ****************************************************************************/
+int setExportDirectory(const char* dirPath)
+{
+	struct stat dirStat;
+
+	if (dirPath == NULL || dirPath[0] == '\0') {
+		exportDirectory[0] = '\0';
+		return 0;
+	}
+	if (stat(dirPath, &dirStat) != 0 || !S_ISDIR(dirStat.st_mode)
+			|| strlen(dirPath) >= sizeof(exportDirectory)) {
+		printf("ERROR: %s is not a usable export directory...\n", dirPath);
+		return -1;
+	}
+	strcpy(exportDirectory, dirPath);
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Create an export file in the export directory, truncating an old one.
+ *
+ * Returns the file descriptor, -1 on failure.
+ *
+ ****************************************************************************/
+static int openExportFile(const char* fileName)
+{
+	char filePath[PATH_MAX];
+	int pathLength;
+
+	if (exportDirectory[0] == '\0' || fileName[0] == '/') {
+		pathLength = snprintf(filePath, sizeof(filePath), "%s", fileName);
+	}
+	else {
+		pathLength = snprintf(filePath, sizeof(filePath), "%s/%s",
+				exportDirectory, fileName);
+	}
+	if (pathLength < 0 || pathLength >= (int)sizeof(filePath)) {
+		printf("ERROR: export path for %s is too long...\n", fileName);
+		return -1;
+	}
+
+	int fd = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		printf("Cannot open export file %s.\n", filePath);
+	}
+	return fd;
+}
+
+/*****************************************************************************
+ *
+ * Write the formatted part of exportText, retrying short writes.
+ *
+ ****************************************************************************/
+static void flushExportText(int fd, size_t length)
+{
+	size_t written = 0;
+	while (written < length) {
+		ssize_t result = write(fd, exportText + written, length - written);
+		if (result <= 0) {
+			printf("ERROR: export write failed...\n");
+			return;
+		}
+		written += result;
+	}
+}
+
 /*****************************************************************************
 *
 * function printIntMatrixToFile()
 *
-* This function prints a type uint8_t 2D buffer to a csv file
+* This function prints a type uint8_t 2D buffer to a csv file, each value
+* followed by a comma and each row by a newline, formatted into one buffer
+* and written with one write()
 *
 *****************************************************************************/
 void printIntMatrixToFile(uint8_t* buffer, const char* filePath,
@@ -73,36 +445,171 @@ void printIntMatrixToFile(uint8_t* buffer, const char* filePath,
 {
 	uint16_t colCount;
 	uint16_t rowCount;
-	FILE * pFile;
-	pFile = fopen(filePath, "w");
+	char* text = exportText;
+	int fd = openExportFile(filePath);
+	if (fd == -1) {
+		return;
+	}
+
 	for (rowCount = 0; rowCount <  numRows; ++rowCount) {
 		for (colCount = 0; colCount < numCols; ++colCount) {
-			fprintf(pFile, "%u,", buffer[rowCount * numCols + colCount]);
+			uint8_t value = buffer[rowCount * numCols + colCount];
+			if (value >= 100) {
+				*text++ = '0' + value / 100;
+			}
+			if (value >= 10) {
+				*text++ = '0' + (value / 10) % 10;
+			}
+			*text++ = '0' + value % 10;
+			*text++ = ',';
 		}
-		fprintf(pFile, "\n");
+		*text++ = '\n';
 	}
-	fclose (pFile);
+	flushExportText(fd, text - exportText);
+	close(fd);
 }
 
 /*****************************************************************************
 *
 * function printIntBufferToFile()
 *
-* this function prints a type uint32_t 1D buffer to a csv file as hex values
+* this function prints a type uint32_t 1D buffer to a csv file as hex values,
+* eight lower case digits per line, formatted into one buffer and written
+* with one write() per buffer full
 *
 *****************************************************************************/
 void printIntBufferToFile(uint32_t* buffer, const char* filePath,
 		int buffSize)
 {
+	static const char hexDigits[] = "0123456789abcdef";
 	int i;
-	FILE * pFile;
-	pFile = fopen(filePath, "w");
-	for (i=0 ; i < buffSize ; i++)
-	{
-		fprintf (pFile, "%08x", buffer[i]);
-		fprintf(pFile, "\n");
+	int8_t shift;
+	char* text = exportText;
+	int fd = openExportFile(filePath);
+	if (fd == -1) {
+		return;
+	}
+
+	for (i = 0; i < buffSize; ++i) {
+		if (text + 9 > exportText + EXPORT_BUFFER_SIZE) {
+			flushExportText(fd, text - exportText);
+			text = exportText;
+		}
+		for (shift = 28; shift >= 0; shift -= 4) {
+			*text++ = hexDigits[(buffer[i] >> shift) & 0xf];
+		}
+		*text++ = '\n';
+	}
+	flushExportText(fd, text - exportText);
+	close(fd);
+}
+
+/*****************************************************************************
+ *
+ * Select the debug trace level.
+ *
+ * supported arguments when calling:	"off"		no trace, the default
+ * 										"binary"	records appended to
+ * 													tracePath
+ * 										"csv"		the CSV files in the
+ * 													setExportDirectory()
+ * 													directory
+ *
+ * Returns 0 on success, -1 if the level is not recognized or the trace
+ * file cannot be opened, the trace is then off.
+ *
+ ****************************************************************************/
+int setTraceLevel(const char* levelName, const char* tracePath)
+{
+	if (fdTrace != -1) {
+		close(fdTrace);
+		fdTrace = -1;
+	}
+	activeTraceLevel = TRACE_OFF;
+
+	if (!strcmp(levelName, "off")) {
+		return 0;
+	}
+	if (!strcmp(levelName, "csv")) {
+		activeTraceLevel = TRACE_CSV;
+		return 0;
+	}
+	if (strcmp(levelName, "binary")) {
+		printf("Unknown trace level: %s\n", levelName);
+		return -1;
+	}
+
+	fdTrace = open(tracePath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fdTrace == -1) {
+		printf("Cannot open trace file %s.\n", tracePath);
+		return -1;
+	}
+	activeTraceLevel = TRACE_BINARY;
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Append one record, a traceRecordHeader and its payload, to the binary
+ * trace with a single writev().
+ *
+ ****************************************************************************/
+static void writeTraceRecord(uint16_t recordType, uint16_t elementSize,
+		uint32_t elementCount, const void* payload)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	traceRecordHeader header = {
+		.magic = TRACE_RECORD_MAGIC,
+		.recordType = recordType,
+		.elementSize = elementSize,
+		.elementCount = elementCount,
+		.reserved = 0,
+		.timestampNs = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec,
+	};
+	struct iovec record[2] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = (void*)payload,
+		  .iov_len = (size_t)elementSize * elementCount },
+	};
+	if (writev(fdTrace, record, 2) == -1) {
+		printf("ERROR: trace write failed...\n");
+	}
+}
+
+/*****************************************************************************
+ *
+ * Trace a MAX_ROWS x MAX_COLS byte matrix at the active trace level.
+ *
+ ****************************************************************************/
+static void traceMatrix(uint16_t recordType, uint8_t* matrix,
+		const char* csvName)
+{
+	if (activeTraceLevel == TRACE_CSV) {
+		printIntMatrixToFile(matrix, csvName, MAX_ROWS * MAX_COLS);
+	}
+	else if (activeTraceLevel == TRACE_BINARY) {
+		writeTraceRecord(recordType, sizeof(uint8_t), MAX_ROWS * MAX_COLS,
+				matrix);
+	}
+}
+
+/*****************************************************************************
+ *
+ * Trace a buffer of 32 bit words at the active trace level.
+ *
+ ****************************************************************************/
+static void traceWords(uint16_t recordType, uint32_t* words,
+		uint32_t wordCount, const char* csvName)
+{
+	if (activeTraceLevel == TRACE_CSV) {
+		printIntBufferToFile(words, csvName, wordCount);
+	}
+	else if (activeTraceLevel == TRACE_BINARY) {
+		writeTraceRecord(recordType, sizeof(uint32_t), wordCount, words);
 	}
-	fclose (pFile);
 }
 
 /*****************************************************************************
@@ -213,10 +720,16 @@ int openAndMapFpgaMemory(const char* pathName)
 	if( fpgaRegBaseAddrPtr == MAP_FAILED ) {
 		printf( "ERROR: mmap() FPGA register failed...\n" );
 		close( fdFpgaReg );
+		fpgaRegBaseAddrPtr = NULL;
+		patternBuffer = NULL;
 		return -1;
 	}
 
 	patternBuffer = (uint32_t*)(fpgaRegBaseAddrPtr + 8 * pageSize);
+	patternRamWriteCombined = NULL;
+	fdPatternRam = -1;
+	bankShadowValid[0] = false;
+	bankShadowValid[1] = false;
 
 	return 0;
 }
@@ -230,7 +743,21 @@ int openAndMapFpgaMemory(const char* pathName)
  ****************************************************************************/
 int closeAndUnmapFpgaMemory(void)
 {
-	if( munmap( (void*)fpgaRegBaseAddrPtr, pageSize * numPages ) != 0 ) {
+	disableConiferIrq();
+	if (patternRamWriteCombined != NULL) {
+		munmap(patternRamWriteCombined, pageSize * numPages - pattRamOffset);
+		patternRamWriteCombined = NULL;
+		patternBuffer = (uint32_t*)(fpgaRegBaseAddrPtr + 8 * pageSize);
+	}
+	if (fdPatternRam != -1) {
+		close(fdPatternRam);
+		fdPatternRam = -1;
+	}
+
+	int unmapResult = munmap( (void*)fpgaRegBaseAddrPtr, pageSize * numPages );
+	fpgaRegBaseAddrPtr = NULL;
+	patternBuffer = NULL;
+	if( unmapResult != 0 ) {
 		printf( "ERROR: munmap() failed...\n" );
 		close( fdFpgaReg );
 		return -1;
@@ -239,6 +766,49 @@ int closeAndUnmapFpgaMemory(void)
 	return 0;
 }
 
+/*****************************************************************************
+ *
+ * Map the pattern Ram a second time for write combined uploads, after
+ * openAndMapFpgaMemory().  The memory attributes come from the driver, so
+ * pathName names a dedicated device node, e.g. a UIO node, whose mapping at
+ * offset 0 is the pattern Ram with bufferable attributes.  patternBuffer is
+ * moved to the new mapping, register access keeps the uncached one.
+ *
+ * Returns 0 on success, -1 on failure, uploads then keep the uncached
+ * mapping.
+ *
+ ****************************************************************************/
+int mapPatternRamWriteCombined(const char* pathName)
+{
+	if (patternRamWriteCombined != NULL) {
+		return 0;
+	}
+	if (pathName == NULL) {
+		printf("ERROR: no pattern Ram device file given...\n");
+		return -1;
+	}
+
+	int fd = open(pathName, O_RDWR);
+	if (fd == -1) {
+		printf("Cannot open pattern Ram device file.\n");
+		return -1;
+	}
+
+	void* mapping = mmap(NULL, pageSize * numPages - pattRamOffset,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		printf("ERROR: mmap() pattern Ram failed...\n");
+		close(fd);
+		return -1;
+	}
+
+	fdPatternRam = fd;
+	patternRamWriteCombined = (uint32_t*)mapping;
+	patternBuffer = patternRamWriteCombined;
+
+	return 0;
+}
+
 /*****************************************************************************
  *
  * Build up the modulation masks from the bit mask header files, for each
@@ -255,8 +825,7 @@ void populateModulationMask(void) {
 		modulationMask[kdkRowBitMask[elemCount] * numCols +
 						 kdkColumnBitMask[elemCount]] = 1;
 	}
-	printIntMatrixToFile(modulationMask, "modMask.csv",
-				sizeof(modulationMask));
+	traceMatrix(TRACE_MODULATION_MASK, modulationMask, "modMask.csv");
 }
 
 /*****************************************************************************
@@ -323,8 +892,7 @@ void populateModulationMatrix(const char* patternType)
 		}
 	}
 
-	printIntMatrixToFile(modulationBuffer, "modBuffer.csv",
-			sizeof(modulationBuffer));
+	traceMatrix(TRACE_MODULATION_MATRIX, modulationBuffer, "modBuffer.csv");
 }
 
 /*****************************************************************************
@@ -355,6 +923,8 @@ void transposeModulationBuffer(void)
 void zeroInitializePatternBuffer(void)
 {
 	memset((uint8_t*)patternBuffer, 0 , 8 * pageSize);
+	bankShadowValid[0] = false;
+	bankShadowValid[1] = false;
 }
 
 /*****************************************************************************
@@ -379,138 +949,2998 @@ void writeBlockMemoryToPatternBuffer(uint16_t* blockStart, uint16_t length,
 		uint16_t offset)
 {
 	memcpy(patternBuffer + offset, blockStart, length);
+	bankShadowValid[0] = false;
+	bankShadowValid[1] = false;
 }
 
 /*****************************************************************************
-*
-* function calcWaveModulation()
-*
-* - calculate the modulation matrix using the wave equation and hardware
-*   parameters
-* - calculations follow those implemented in:
-* 		mtennaLib->Viking2.py->calculate_modulation()
-* - arguments:	3 angles normally determined by antenna control algorithms
-* - returns:	none
-*
-*****************************************************************************/
-void calcWaveModulation(double theta, double phi, double phase)
+ *
+ * Pattern Ram bank the HPS currently writes, from bank_sel_hps, which the
+ * bank protocol toggles by writing back its complement.
+ *
+ ****************************************************************************/
+static inline uint8_t currentHpsBank(void)
 {
-	double eTheta;
-	double ePhi;
-	double complex waveIn;
-	double complex waveOutTheta;
-	double complex waveOutPhi;
-	double complex modulation;
-	double waveOutAngle;
-	double tempMaxVal = 0.0;
-	double maxModVal = 0.0;
-	double rho;
-	double rhoRound;
-
-	double freq = freqCoeff * pow(10.0, 9.0);	// frequency in GHz
-	double c = m * pow(10.0, 8.0);          // speed of light
-	double kf = 2.0 * pi * freq / c;      	// wave number in free space
-	double ks = kf * indexOfRefraction;  // wave number in the substrate
-	double lPar = linearPolAngle * (pi / 180.0);
-	double thetaMag = cos(lPar);
-	double phiMag = sin(lPar);
+	return (uint8_t)(readRegisterValue(bankSelHpsOffset) & 1);
+}
 
-	theta *= (pi / 180.0);
-	phi *= (pi / 180.0);
-	phase *= (pi / 180.0);
+/*****************************************************************************
+ *
+ * Wait for all outstanding memory accesses to complete, so pattern words
+ * reach the FPGA before and after the bank select registers are written.
+ *
+ ****************************************************************************/
+static inline void patternWriteBarrier(void)
+{
+#if defined(__arm__)
+	__asm__ __volatile__ ("dsb sy" : : : "memory");
+#else
+	__sync_synchronize();
+#endif
+}
 
-	uint16_t loopCount;
-	for (loopCount = 0; loopCount < ACTV_CELLS; ++ loopCount) {
-		eTheta = (sin(phi + kdkRotGeoVal[loopCount]))
-				* (1.0 / eThetaElement);
-		ePhi = (cos(phi + kdkRotGeoVal[loopCount]))
-				* (1.0 / ePhiElement);
-		rho = sqrt(pow(kdkXGeoVal[loopCount], 2) +  pow(kdkYGeoVal[loopCount], 
-				2));
-		rhoRound = (floor(rho * 10000.0)) / 10000.0;
-		waveIn = cos(ks * rhoRound) + sin(ks * rhoRound) * I;
-		waveOutAngle = kf * (kdkXGeoVal[loopCount] * sin(theta) * cos(phi) +
-							 kdkYGeoVal[loopCount] * sin(theta) * sin(phi));
-		waveOutTheta = thetaMag * (cos(waveOutAngle) + sin(waveOutAngle) * I);
-		waveOutPhi = phiMag * (cos(phase) + sin(phase) * I)
-							* (cos(waveOutAngle) + sin(waveOutAngle) * I);
-		modulation = waveIn * waveOutTheta * eTheta
-				   + waveIn * waveOutPhi * ePhi;
-		tempMaxVal = fabs(modulation);
-		maxModVal = (maxModVal > tempMaxVal ? maxModVal : tempMaxVal);
-		modulationReal[loopCount] = creal(modulation);
-	}
+/*****************************************************************************
+ *
+ * Monotonic time stamp in nanoseconds.
+ *
+ ****************************************************************************/
+static inline uint64_t readTimestampNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
 
-	for (loopCount = 0; loopCount < ACTV_CELLS; ++ loopCount) {
-		double modulationTemp = pow(((modulationReal[loopCount] + maxModVal)
-										/ (2.0 * maxModVal)), modPower);
-		modulationTemp *= (grayShades - 1);
-		modulationWave[loopCount] = (uint32_t)(floor(modulationTemp
-										/ (grayShades - 1)));
+#if defined(__arm__)
+/*****************************************************************************
+ *
+ * Read the Cortex-A9 PMU cycle counter, PMCCNTR.  Faults unless the kernel
+ * enabled user access, setStageTiming() checks PMUSERENR first.
+ *
+ ****************************************************************************/
+static inline uint32_t readCycleCounter(void)
+{
+	uint32_t cycles;
+	__asm__ __volatile__ ("mrc p15, 0, %0, c9, c13, 0" : "=r" (cycles));
+	return cycles;
+}
+#endif
 
-		// map to modulation array mask...
+/*****************************************************************************
+ *
+ * Select the clock used to time the update stages.
+ *
+ * supported arguments when calling:	"off"			no timing, the default
+ * 										"monotonic"		CLOCK_MONOTONIC
+ * 										"cycle counter"	A9 PMU cycle counter,
+ * 														cpuMHz converts it
+ *
+ * Returns 0 on success, -1 if the clock is not recognized or the cycle
+ * counter is not available to user space, the timing is then off.
+ *
+ ****************************************************************************/
+int setStageTiming(const char* clockName, uint32_t cpuMHz)
+{
+	stageClock = STAGE_CLOCK_OFF;
 
-		// for each row, column pair, write a 1 into the mask matrix
-		waveModMask[kdkRowBitMask[loopCount] * numCols +
-					kdkColumnBitMask[loopCount]] = modulationWave[loopCount];
+	if (!strcmp(clockName, "off")) {
+		return 0;
+	}
+	if (!strcmp(clockName, "monotonic")) {
+		stageClock = STAGE_CLOCK_MONOTONIC;
+		return 0;
+	}
+	if (strcmp(clockName, "cycle counter")) {
+		printf("Unknown stage timing clock: %s\n", clockName);
+		return -1;
 	}
 
-	// output data for comparison with Python generated values...
-	printIntBufferToFile((uint32_t*)waveModMask, "waveModulationMatrix.csv", 
-			ACTV_CELLS);
+#if defined(__arm__)
+	uint32_t userEnable;
+	uint32_t pmuControl;
+	__asm__ __volatile__ ("mrc p15, 0, %0, c9, c14, 0" : "=r" (userEnable));
+	if ((userEnable & 1) == 0 || cpuMHz == 0) {
+		printf("ERROR: cycle counter not enabled for user space...\n");
+		return -1;
+	}
+	__asm__ __volatile__ ("mrc p15, 0, %0, c9, c12, 0" : "=r" (pmuControl));
+	if ((pmuControl & 1) == 0) {
+		printf("ERROR: cycle counter not running...\n");
+		return -1;
+	}
+	// PMCR.D counts every 64th cycle
+	cyclesPerTick = ((pmuControl & 8) ? 64 : 1);
+	cpuClockMHz = cpuMHz;
+	stageClock = STAGE_CLOCK_CYCLES;
+	return 0;
+#else
+	(void)cpuMHz;
+	printf("ERROR: no cycle counter on this target...\n");
+	return -1;
+#endif
 }
 
 /*****************************************************************************
  *
- * Re-code from scratch... using the spreadsheet as guide
- *
- * assume the pattern buffer has been zero initialized
- * placement algorithm repeats for each row
- *
- * the bit to set is either byte1 plus offset or byte3 + offset
- * byte0 and byte2 are unused and stay all 0
- * so:
- * 		start of byte1 == 8, start of byte3 == 24
+ * Start timing a stage, returns the start time in ticks of the selected
+ * clock.
  *
- *	the pattern buffer index value is byte offset + row * 10
+ ****************************************************************************/
+static inline uint64_t startStageTimer(void)
+{
+	if (stageClock == STAGE_CLOCK_MONOTONIC) {
+		return readTimestampNs();
+	}
+#if defined(__arm__)
+	if (stageClock == STAGE_CLOCK_CYCLES) {
+		return readCycleCounter();
+	}
+#endif
+	return 0;
+}
+
+/*****************************************************************************
  *
- * 	for each row
- * 		set each word value to zero
- * 		for each column
- * 			get byte and offset value from array in include header
- * 			if modulation [row][col] == 1
- * 				index into the correct word in the pattern buffer
- *				set bit correspond to bit position = byte value + offset
+ * Stop timing a stage and record the elapsed time in nanoseconds.
  *
  ****************************************************************************/
-void formatAndWriteModulationToFPGAKDKFromScratch(void)
+static void stopStageTimer(latencyStage stage, uint64_t startTicks)
 {
-	uint32_t zeroValue = 0;
-	memset(zeroBuffer, zeroValue, BUF_SIZE);
-	uint16_t rowCount;
-	uint16_t colCount;
-	uint8_t byteOffset;
-	uint32_t mask;
-	for (rowCount = 0; rowCount <  numRows; ++rowCount) {
-		for (colCount = 0; colCount < numCols; ++colCount) {
-			byteOffset = byteOffsetsByColumn[colCount];
-			mask = 1 << (byteStartingBitValuesByColumn[colCount]
-						+ bitShiftValueByColumn[colCount]);
-			if (modulationBuffer[rowCount * numCols + colCount] == 1) {
-				zeroBuffer[byteOffset + rowCount * rowGroupSize] |= mask;
-			}
-			else {
-				zeroBuffer[byteOffset + rowCount * rowGroupSize] &= ~mask;
-			}
+	uint64_t elapsedNs;
+
+	if (stageClock == STAGE_CLOCK_OFF) {
+		return;
+	}
+	if (stageClock == STAGE_CLOCK_MONOTONIC) {
+		elapsedNs = readTimestampNs() - startTicks;
+	}
+	else {
+#if defined(__arm__)
+		// the counter is 32 bits, the difference survives one wrap
+		uint32_t ticks = readCycleCounter() - (uint32_t)startTicks;
+		elapsedNs = (uint64_t)ticks * cyclesPerTick * 1000 / cpuClockMHz;
+#else
+		return;
+#endif
+	}
+
+	uint32_t sampleNs = (elapsedNs > UINT32_MAX ? UINT32_MAX :
+			(uint32_t)elapsedNs);
+	uint32_t count = stageLatency.count[stage];
+	if (count == 0 || sampleNs < stageLatency.minNs[stage]) {
+		stageLatency.minNs[stage] = sampleNs;
+	}
+	if (sampleNs > stageLatency.maxNs[stage]) {
+		stageLatency.maxNs[stage] = sampleNs;
+	}
+	stageLatency.totalNs[stage] += sampleNs;
+	stageLatency.samples[stage][count % LATENCY_SAMPLES] = sampleNs;
+	stageLatency.count[stage] = count + 1;
+}
+
+/*****************************************************************************
+ *
+ * Compare two latency samples for qsort().
+ *
+ ****************************************************************************/
+static int compareLatencySamples(const void* first, const void* second)
+{
+	uint32_t firstSample = *(const uint32_t*)first;
+	uint32_t secondSample = *(const uint32_t*)second;
+	return (firstSample > secondSample) - (firstSample < secondSample);
+}
+
+/*****************************************************************************
+ *
+ * Report the latency of one stage, min, mean and max over every sample
+ * since the last reset, the 99th percentile over the latest
+ * LATENCY_SAMPLES samples.  The samples are sorted in a local copy, so
+ * several threads may ask at once.
+ *
+ * Returns 0 on success, -1 if the stage is not known.
+ *
+ ****************************************************************************/
+int getStageStats(latencyStage stage, stageLatencyStats* stats)
+{
+	uint32_t sortedSamples[LATENCY_SAMPLES];	// 4 KB, on the caller's stack
+
+	if ((unsigned)stage >= NUM_LATENCY_STAGES) {
+		printf("Unknown latency stage: %d\n", (int)stage);
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	uint32_t count = stageLatency.count[stage];
+	if (count == 0) {
+		return 0;
+	}
+
+	uint32_t sampleCount = (count < LATENCY_SAMPLES ? count : LATENCY_SAMPLES);
+	memcpy(sortedSamples, stageLatency.samples[stage],
+			sampleCount * sizeof(uint32_t));
+	qsort(sortedSamples, sampleCount, sizeof(uint32_t),
+			compareLatencySamples);
+
+	stats->count = count;
+	stats->minNs = stageLatency.minNs[stage];
+	stats->meanNs = (uint32_t)(stageLatency.totalNs[stage] / count);
+	stats->maxNs = stageLatency.maxNs[stage];
+	stats->p99Ns = sortedSamples[(sampleCount * 99 + 99) / 100 - 1];
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Clear the latency statistics of every stage.
+ *
+ ****************************************************************************/
+void resetStageStats(void)
+{
+	memset(&stageLatency, 0, sizeof(stageLatency));
+}
+
+/*****************************************************************************
+ *
+ * Pause between bursts of a paced pattern upload.
+ *
+ ****************************************************************************/
+static void pausePatternWrite(void)
+{
+	if (writePacing == PACING_SLEEP) {
+		usleep((pauseNanoseconds + 999) / 1000);
+	}
+	else if (writePacing == PACING_SPIN) {
+		uint64_t pauseEnd = readTimestampNs() + pauseNanoseconds;
+		while (readTimestampNs() < pauseEnd) {
 		}
 	}
-	printIntBufferToFile(zeroBuffer, "desiredPatternBuffer.csv",
-				numRows * rowGroupSize);
-	int i;
+}
+
+/*****************************************************************************
+ *
+ * Select how pattern uploads are paced.
+ *
+ * supported arguments when calling:	"none"	one burst, the default
+ * 										"sleep"	usleep() between bursts
+ * 										"spin"	busy wait between bursts
+ *
+ * Returns 0 on success, -1 if the pacing mode is not recognized.
+ *
+ ****************************************************************************/
+int setPatternWritePacing(const char* pacingMode, uint32_t burstWords,
+		uint32_t pauseNs)
+{
+	if (!strcmp(pacingMode, "none")) {
+		writePacing = PACING_NONE;
+	}
+	else if (!strcmp(pacingMode, "sleep")) {
+		writePacing = PACING_SLEEP;
+	}
+	else if (!strcmp(pacingMode, "spin")) {
+		writePacing = PACING_SPIN;
+	}
+	else {
+		printf("Unknown pattern write pacing: %s\n", pacingMode);
+		return -1;
+	}
+	wordsPerPause = (burstWords == 0 ? BUF_SIZE : burstWords);
+	pauseNanoseconds = pauseNs;
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Copy count words of a packed pattern into pattern Ram.  With the write
+ * combined mapping the words go out as 64 byte NEON stores, otherwise as
+ * single word stores.
+ *
+ ****************************************************************************/
+static void copyPatternWords(volatile uint32_t* pattRam,
+		const uint32_t* packedPattern, uint32_t count)
+{
+	uint32_t i = 0;
+#ifdef USE_NEON_KERNELS
+	if (patternRamWriteCombined != NULL) {
+		for (; i < count && ((uintptr_t)&pattRam[i] & 15) != 0; ++i) {
+			pattRam[i] = packedPattern[i];
+		}
+		uint32_t* burstRam = (uint32_t*)&pattRam[i];
+		for (; i + PATTERN_BURST_WORDS <= count; i += PATTERN_BURST_WORDS) {
+			uint32x4_t burst0 = vld1q_u32(&packedPattern[i]);
+			uint32x4_t burst1 = vld1q_u32(&packedPattern[i + 4]);
+			uint32x4_t burst2 = vld1q_u32(&packedPattern[i + 8]);
+			uint32x4_t burst3 = vld1q_u32(&packedPattern[i + 12]);
+			vst1q_u32(burstRam, burst0);
+			vst1q_u32(burstRam + 4, burst1);
+			vst1q_u32(burstRam + 8, burst2);
+			vst1q_u32(burstRam + 12, burst3);
+			burstRam += PATTERN_BURST_WORDS;
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		pattRam[i] = packedPattern[i];
+	}
+}
+
+/*****************************************************************************
+ *
+ * Remember the bank and time of a pattern Ram write for the snapshots.
+ *
+ ****************************************************************************/
+static inline void latchPatternWrite(uint8_t bank)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	patternWriteLatch.bank = bank;
+	patternWriteLatch.timestampNs = (uint64_t)now.tv_sec * 1000000000ull
+			+ now.tv_nsec;
+}
+
+/*****************************************************************************
+ *
+ * Copy a packed pattern into pattern Ram, as one burst or in bursts of
+ * wordsPerPause words when pacing is selected, with a barrier on both
+ * sides of the copy.
+ *
+ ****************************************************************************/
+void writePackedPatternToFPGA(const uint32_t* packedPattern)
+{
+	volatile uint32_t* pattRam = patternBuffer;
+	uint32_t burstEnd;
+	uint32_t i = 0;
+	uint64_t stageStart = startStageTimer();
+
+	patternWriteBarrier();
+	while (i < BUF_SIZE) {
+		burstEnd = (writePacing == PACING_NONE || BUF_SIZE - i < wordsPerPause ?
+				BUF_SIZE : i + wordsPerPause);
+		copyPatternWords(&pattRam[i], &packedPattern[i], burstEnd - i);
+		i = burstEnd;
+		if (i < BUF_SIZE) {
+			patternWriteBarrier();
+			pausePatternWrite();
+		}
+	}
+	patternWriteBarrier();
+
+	uint8_t bank = currentHpsBank();
+	memcpy(bankShadow[bank], packedPattern, sizeof(bankShadow[bank]));
+	bankShadowValid[bank] = true;
+	latchPatternWrite(bank);
+	stopStageTimer(STAGE_UPLOAD, stageStart);
+}
+
+/*****************************************************************************
+ *
+ * Fill the byte wise CRC32 table for the reflected 0xEDB88320 polynomial,
+ * only does the work on the first call.
+ *
+ ****************************************************************************/
+static void initCrc32Table(void)
+{
+	if (crc32TableValid) {
+		return;
+	}
+
+	uint32_t byteValue;
+	uint32_t crc;
+	uint8_t bitCount;
+	for (byteValue = 0; byteValue < 256; ++byteValue) {
+		crc = byteValue;
+		for (bitCount = 0; bitCount < 8; ++bitCount) {
+			crc = (crc >> 1) ^ (CRC32_POLYNOMIAL & -(crc & 1));
+		}
+		crc32Table[byteValue] = crc;
+	}
+	crc32TableValid = true;
+}
+
+/*****************************************************************************
+ *
+ * Fold one 32 bit word into a running CRC32, least significant byte first
+ * so the result matches a CRC32 of the little endian buffer in memory.
+ *
+ ****************************************************************************/
+static inline uint32_t crc32Word(uint32_t crc, uint32_t word)
+{
+	crc = crc32Table[(crc ^ word) & 0xff] ^ (crc >> 8);
+	crc = crc32Table[(crc ^ (word >> 8)) & 0xff] ^ (crc >> 8);
+	crc = crc32Table[(crc ^ (word >> 16)) & 0xff] ^ (crc >> 8);
+	return crc32Table[(crc ^ (word >> 24)) & 0xff] ^ (crc >> 8);
+}
+
+/*****************************************************************************
+ *
+ * CRC32 of the BUF_SIZE words of a packed pattern, the same value zlib's
+ * crc32() gives for the buffer.
+ *
+ ****************************************************************************/
+uint32_t calcPatternCrc32(const uint32_t* packedPattern)
+{
+	initCrc32Table();
+
+	uint32_t crc = 0xffffffffu;
+	uint32_t i;
 	for (i = 0; i < BUF_SIZE; ++i) {
-		patternBuffer[i] = zeroBuffer[i];
-		usleep(25);
+		crc = crc32Word(crc, packedPattern[i]);
 	}
-	printIntBufferToFile(patternBuffer, "actualPatternBuffer.csv",
-				numRows * rowGroupSize);
+	return ~crc;
+}
+
+/*****************************************************************************
+ *
+ * Select when commits read pattern Ram back and check it.
+ *
+ * supported arguments when calling:	"off"			never
+ * 										"every commit"	the default
+ * 										"every n"		every interval commits
+ *
+ * Returns 0 on success, -1 if the mode is not recognized.
+ *
+ ****************************************************************************/
+int setPatternVerify(const char* verifyName, uint32_t interval)
+{
+	if (!strcmp(verifyName, "off")) {
+		verifyMode = VERIFY_OFF;
+	}
+	else if (!strcmp(verifyName, "every commit")) {
+		verifyMode = VERIFY_EVERY_COMMIT;
+	}
+	else if (!strcmp(verifyName, "every n")) {
+		verifyMode = VERIFY_EVERY_N;
+	}
+	else {
+		printf("Unknown pattern verify mode: %s\n", verifyName);
+		return -1;
+	}
+	verifyInterval = (interval == 0 ? 1 : interval);
+	commitsSinceVerify = 0;
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Read pattern Ram back and compare its CRC32 with the CRC32 of the staged
+ * pattern.
+ *
+ * Returns 0 when they match, -1 otherwise.
+ *
+ ****************************************************************************/
+int verifyPatternWrite(const uint32_t* packedPattern)
+{
+	volatile uint32_t* pattRam = patternBuffer;
+	uint32_t stagedCrc = calcPatternCrc32(packedPattern);
+	uint32_t readbackCrc = 0xffffffffu;
+	uint32_t i;
+
+	patternWriteBarrier();
+	for (i = 0; i < BUF_SIZE; ++i) {
+		readbackCrc = crc32Word(readbackCrc, pattRam[i]);
+	}
+	readbackCrc = ~readbackCrc;
+
+	if (readbackCrc != stagedCrc) {
+		printf("ERROR: pattern Ram CRC32 0x%08x, expected 0x%08x...\n",
+				readbackCrc, stagedCrc);
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Run verifyPatternWrite() when the verify mode says this commit is due.
+ * On a mismatch the shadow copy of the bank is dropped, so the next upload
+ * rewrites the whole bank.
+ *
+ * Returns 0 when the check passes or is skipped, -1 on a mismatch.
+ *
+ ****************************************************************************/
+static int verifyCommittedPattern(const uint32_t* packedPattern)
+{
+	if (verifyMode == VERIFY_OFF) {
+		return 0;
+	}
+	if (verifyMode == VERIFY_EVERY_N
+			&& ++commitsSinceVerify < verifyInterval) {
+		return 0;
+	}
+	commitsSinceVerify = 0;
+
+	if (verifyPatternWrite(packedPattern) != 0) {
+		bankShadowValid[currentHpsBank()] = false;
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Write only the words of a packed pattern that differ from what the bank
+ * selected by bank_sel_hps already holds, going by its shadow copy.  The
+ * comparison runs 4 words at a time with NEON.  When the bank contents are
+ * not known the whole pattern is written.
+ *
+ * Returns the number of words written.
+ *
+ ****************************************************************************/
+uint32_t writePatternDelta(const uint32_t* packedPattern)
+{
+	uint8_t bank = currentHpsBank();
+	if (!bankShadowValid[bank]) {
+		writePackedPatternToFPGA(packedPattern);
+		return BUF_SIZE;
+	}
+
+	volatile uint32_t* pattRam = patternBuffer;
+	uint32_t* shadow = bankShadow[bank];
+	uint32_t dirtyWords = 0;
+	uint32_t i = 0;
+	uint64_t stageStart = startStageTimer();
+#ifdef USE_NEON_KERNELS
+	uint32_t j;
+#endif
+
+	patternWriteBarrier();
+#ifdef USE_NEON_KERNELS
+	for (; i + 4 <= BUF_SIZE; i += 4) {
+		uint32x4_t diff = veorq_u32(vld1q_u32(&packedPattern[i]),
+				vld1q_u32(&shadow[i]));
+		uint32x2_t diffPair = vorr_u32(vget_low_u32(diff),
+				vget_high_u32(diff));
+		if ((vget_lane_u32(diffPair, 0) | vget_lane_u32(diffPair, 1)) == 0) {
+			continue;
+		}
+		for (j = i; j < i + 4; ++j) {
+			if (packedPattern[j] != shadow[j]) {
+				pattRam[j] = packedPattern[j];
+				shadow[j] = packedPattern[j];
+				++dirtyWords;
+			}
+		}
+	}
+#endif
+	for (; i < BUF_SIZE; ++i) {
+		if (packedPattern[i] != shadow[i]) {
+			pattRam[i] = packedPattern[i];
+			shadow[i] = packedPattern[i];
+			++dirtyWords;
+		}
+	}
+	patternWriteBarrier();
+	latchPatternWrite(bank);
+	stopStageTimer(STAGE_UPLOAD, stageStart);
+
+	return dirtyWords;
+}
+
+/*****************************************************************************
+*
+* function angleToTurns()
+*
+* - convert an angle in turns to an unsigned 32 bit fraction of a turn,
+*   whole turns wrap away
+* - returns:	the angle scaled by 2^32, modulo 2^32
+*
+*****************************************************************************/
+static uint32_t angleToTurns(double turns)
+{
+	double fraction = turns - floor(turns);
+	return (uint32_t)(uint64_t)llround(ldexp(fraction, 32));
+}
+
+/*****************************************************************************
+*
+* function initCellGeometry()
+*
+* - compute the wave numbers and the angle independent per-cell terms of the
+*   wave equation, so each steering update only evaluates the terms that
+*   depend on theta, phi and phase
+* - only does the work on the first call, later calls return immediately
+* - returns:	none
+*
+*****************************************************************************/
+void initCellGeometry(void)
+{
+	if (cellGeometryValid) {
+		return;
+	}
+
+	double freq = freqCoeff * pow(10.0, 9.0);	// frequency in GHz
+	double c = m * pow(10.0, 8.0);          // speed of light
+	kf = 2.0 * pi * freq / c;
+	ks = kf * indexOfRefraction;
+	double lPar = linearPolAngle * (pi / 180.0);
+	polThetaMag = cos(lPar);
+	polPhiMag = sin(lPar);
+	polAngleDegrees = atan2(polPhiMag, polThetaMag) * (180.0 / pi);
+
+	uint16_t loopCount;
+	for (loopCount = 0; loopCount < ACTV_CELLS; ++loopCount) {
+		double x = kdkXGeoVal[loopCount];
+		double y = kdkYGeoVal[loopCount];
+		double rho = sqrt(x * x + y * y);
+		double rhoRound = (floor(rho * 10000.0)) / 10000.0;
+		cellGeometry.waveInReal[loopCount] = cos(ks * rhoRound);
+		cellGeometry.waveInImag[loopCount] = sin(ks * rhoRound);
+		cellGeometry.rotCos[loopCount] = cos(kdkRotGeoVal[loopCount]);
+		cellGeometry.rotSin[loopCount] = sin(kdkRotGeoVal[loopCount]);
+
+		cellGeometryF32.x[loopCount] = (float)x;
+		cellGeometryF32.y[loopCount] = (float)y;
+		cellGeometryF32.waveInAngle[loopCount] =
+				(float)remainder(ks * rhoRound, 2.0 * M_PI);
+		cellGeometryF32.rotCos[loopCount] = (float)cellGeometry.rotCos[loopCount];
+		cellGeometryF32.rotSin[loopCount] = (float)cellGeometry.rotSin[loopCount];
+
+		cellGeometryFixed.x[loopCount] = (int32_t)lround(ldexp(x, 24));
+		cellGeometryFixed.y[loopCount] = (int32_t)lround(ldexp(y, 24));
+		cellGeometryFixed.waveInTurns[loopCount] =
+				angleToTurns(ks * rhoRound / (2.0 * M_PI));
+		cellGeometryFixed.rotTurns[loopCount] =
+				angleToTurns(kdkRotGeoVal[loopCount] / (2.0 * M_PI));
+	}
+
+	uint16_t tableIndex;
+	for (tableIndex = 0; tableIndex < SINE_TABLE_SIZE; ++tableIndex) {
+		sineTableQ15[tableIndex] = (int16_t)lround(32767.0
+				* sin(2.0 * M_PI * tableIndex / SINE_TABLE_SIZE));
+	}
+	cellGeometryValid = true;
+}
+
+/*****************************************************************************
+*
+* function calcSteeringTerms()
+*
+* - convert the steering angles, in degrees, to the terms shared by every
+*   cell in the wave kernels
+* - initCellGeometry() must have been called
+* - returns:	none
+*
+*****************************************************************************/
+static void calcSteeringTerms(double theta, double phi, double phase,
+		steeringTerms* terms)
+{
+	theta *= (pi / 180.0);
+	phi *= (pi / 180.0);
+	phase *= (pi / 180.0);
+
+	terms->sinPhi = sin(phi);
+	terms->cosPhi = cos(phi);
+	terms->xScale = kf * sin(theta) * terms->cosPhi;
+	terms->yScale = kf * sin(theta) * terms->sinPhi;
+	terms->thetaMag = polThetaMag;
+	terms->phiMagCos = polPhiMag * cos(phase);
+	terms->phiMagSin = polPhiMag * sin(phase);
+	terms->phiTurns = phi / (2.0 * M_PI);
+}
+
+/*****************************************************************************
+*
+* function calcWaveKernelDouble()
+*
+* - reference double precision wave equation kernel, uses complex.h and libm
+*   exactly as mtennaLib->Viking2.py->calculate_modulation() does
+* - sin(phi + rot) and cos(phi + rot) are expanded with the cached rotation
+*   terms
+* - returns:	largest magnitude of the real modulation in the range
+*
+*****************************************************************************/
+static double calcWaveKernelDouble(const steeringTerms* terms,
+		uint16_t first, uint16_t last)
+{
+	double eTheta;
+	double ePhi;
+	double complex waveIn;
+	double complex waveOut;
+	double complex waveOutTheta;
+	double complex waveOutPhi;
+	double complex modulation;
+	double waveOutAngle;
+	double tempMaxVal = 0.0;
+	double maxModVal = 0.0;
+	double complex phiWeight = terms->phiMagCos + terms->phiMagSin * I;
+
+	uint16_t loopCount;
+	for (loopCount = first; loopCount < last; ++ loopCount) {
+		eTheta = (terms->sinPhi * cellGeometry.rotCos[loopCount]
+				+ terms->cosPhi * cellGeometry.rotSin[loopCount])
+				* (1.0 / eThetaElement);
+		ePhi = (terms->cosPhi * cellGeometry.rotCos[loopCount]
+				- terms->sinPhi * cellGeometry.rotSin[loopCount])
+				* (1.0 / ePhiElement);
+		waveIn = cellGeometry.waveInReal[loopCount]
+				+ cellGeometry.waveInImag[loopCount] * I;
+		waveOutAngle = kdkXGeoVal[loopCount] * terms->xScale
+					 + kdkYGeoVal[loopCount] * terms->yScale;
+		waveOut = cos(waveOutAngle) + sin(waveOutAngle) * I;
+		waveOutTheta = terms->thetaMag * waveOut;
+		waveOutPhi = phiWeight * waveOut;
+		modulation = waveIn * waveOutTheta * eTheta
+				   + waveIn * waveOutPhi * ePhi;
+		tempMaxVal = fabs(modulation);
+		maxModVal = (maxModVal > tempMaxVal ? maxModVal : tempMaxVal);
+		modulationReal[loopCount] = creal(modulation);
+		waveIn *= waveOut;
+		lastPointing.waveRe[loopCount] = creal(waveIn);
+		lastPointing.waveIm[loopCount] = cimag(waveIn);
+	}
+	return maxModVal;
+}
+
+// Cephes single precision sin/cos coefficients, argument reduced to
+// +/- pi / 4 with a 3 part Cody-Waite split of pi / 4
+static const float fourOverPiF32 = 1.27323954473516f;
+static const float piOver4AF32 = 0.78515625f;
+static const float piOver4BF32 = 2.4187564849853515625e-4f;
+static const float piOver4CF32 = 3.77489497744594108e-8f;
+static const float sinCoeff0F32 = -1.9515295891e-4f;
+static const float sinCoeff1F32 = 8.3321608736e-3f;
+static const float sinCoeff2F32 = -1.6666654611e-1f;
+static const float cosCoeff0F32 = 2.443315711809948e-5f;
+static const float cosCoeff1F32 = -1.388731625493765e-3f;
+static const float cosCoeff2F32 = 4.166664568298827e-2f;
+
+/*****************************************************************************
+*
+* function sinCosF32()
+*
+* - single precision polynomial sin and cos of one angle in radians
+* - every operation mirrors one NEON instruction in sinCosF32x4(), in the
+*   same order, so both give bit identical results
+* - returns:	none
+*
+*****************************************************************************/
+static inline void sinCosF32(float angle, float* sinOut, float* cosOut)
+{
+	bool sinNegative = (angle < 0.0f);
+	float x = fabsf(angle);
+	int32_t quadrant = (int32_t)(x * fourOverPiF32);
+	quadrant = (quadrant + 1) & ~1;
+	float y = (float)quadrant;
+	x = x - y * piOver4AF32;
+	x = x - y * piOver4BF32;
+	x = x - y * piOver4CF32;
+
+	sinNegative ^= ((quadrant & 4) != 0);
+	bool cosPositive = (((uint32_t)quadrant - 2) & 4) != 0;
+	bool swapPolys = ((quadrant & 2) != 0);
+
+	float z = x * x;
+	float polyCos = cosCoeff0F32 * z;
+	polyCos = polyCos + cosCoeff1F32;
+	polyCos = polyCos * z;
+	polyCos = polyCos + cosCoeff2F32;
+	polyCos = polyCos * z;
+	polyCos = polyCos * z;
+	polyCos = polyCos - 0.5f * z;
+	polyCos = polyCos + 1.0f;
+
+	float polySin = sinCoeff0F32 * z;
+	polySin = polySin + sinCoeff1F32;
+	polySin = polySin * z;
+	polySin = polySin + sinCoeff2F32;
+	polySin = polySin * z;
+	polySin = polySin * x;
+	polySin = polySin + x;
+
+	float sinVal = swapPolys ? polyCos : polySin;
+	float cosVal = swapPolys ? polySin : polyCos;
+	*sinOut = sinNegative ? -sinVal : sinVal;
+	*cosOut = cosPositive ? cosVal : -cosVal;
+}
+
+#ifdef USE_NEON_KERNELS
+/*****************************************************************************
+*
+* function sinCosF32x4()
+*
+* - NEON version of sinCosF32(), 4 angles per call
+* - returns:	none
+*
+*****************************************************************************/
+static inline void sinCosF32x4(float32x4_t angle, float32x4_t* sinOut,
+		float32x4_t* cosOut)
+{
+	uint32x4_t sinNegative = vcltq_f32(angle, vdupq_n_f32(0.0f));
+	float32x4_t x = vabsq_f32(angle);
+	int32x4_t quadrant = vcvtq_s32_f32(vmulq_f32(x,
+			vdupq_n_f32(fourOverPiF32)));
+	quadrant = vandq_s32(vaddq_s32(quadrant, vdupq_n_s32(1)),
+			vdupq_n_s32(~1));
+	float32x4_t y = vcvtq_f32_s32(quadrant);
+	x = vsubq_f32(x, vmulq_f32(y, vdupq_n_f32(piOver4AF32)));
+	x = vsubq_f32(x, vmulq_f32(y, vdupq_n_f32(piOver4BF32)));
+	x = vsubq_f32(x, vmulq_f32(y, vdupq_n_f32(piOver4CF32)));
+
+	uint32x4_t quadrantBits = vreinterpretq_u32_s32(quadrant);
+	sinNegative = veorq_u32(sinNegative,
+			vtstq_u32(quadrantBits, vdupq_n_u32(4)));
+	uint32x4_t cosPositive = vtstq_u32(vsubq_u32(quadrantBits,
+			vdupq_n_u32(2)), vdupq_n_u32(4));
+	uint32x4_t swapPolys = vtstq_u32(quadrantBits, vdupq_n_u32(2));
+
+	float32x4_t z = vmulq_f32(x, x);
+	float32x4_t polyCos = vmulq_f32(vdupq_n_f32(cosCoeff0F32), z);
+	polyCos = vaddq_f32(polyCos, vdupq_n_f32(cosCoeff1F32));
+	polyCos = vmulq_f32(polyCos, z);
+	polyCos = vaddq_f32(polyCos, vdupq_n_f32(cosCoeff2F32));
+	polyCos = vmulq_f32(polyCos, z);
+	polyCos = vmulq_f32(polyCos, z);
+	polyCos = vsubq_f32(polyCos, vmulq_f32(vdupq_n_f32(0.5f), z));
+	polyCos = vaddq_f32(polyCos, vdupq_n_f32(1.0f));
+
+	float32x4_t polySin = vmulq_f32(vdupq_n_f32(sinCoeff0F32), z);
+	polySin = vaddq_f32(polySin, vdupq_n_f32(sinCoeff1F32));
+	polySin = vmulq_f32(polySin, z);
+	polySin = vaddq_f32(polySin, vdupq_n_f32(sinCoeff2F32));
+	polySin = vmulq_f32(polySin, z);
+	polySin = vmulq_f32(polySin, x);
+	polySin = vaddq_f32(polySin, x);
+
+	float32x4_t sinVal = vbslq_f32(swapPolys, polyCos, polySin);
+	float32x4_t cosVal = vbslq_f32(swapPolys, polySin, polyCos);
+	*sinOut = vbslq_f32(sinNegative, vnegq_f32(sinVal), sinVal);
+	*cosOut = vbslq_f32(cosPositive, cosVal, vnegq_f32(cosVal));
+}
+#endif
+
+/*****************************************************************************
+*
+* function calcWaveKernelF32()
+*
+* - single precision wave equation kernel, the modulation is evaluated as
+*   waveIn * waveOut * (thetaMag * eTheta + phiMag * e^(i phase) * ePhi)
+*   with the incident and outgoing waves folded into one angle
+* - 4 cells per iteration with NEON on the A9, the scalar loop handles the
+*   remainder and is the whole kernel on other targets, both paths give bit
+*   identical output
+* - returns:	largest magnitude of the real modulation in the range
+*
+*****************************************************************************/
+static double calcWaveKernelF32(const steeringTerms* terms,
+		uint16_t first, uint16_t last)
+{
+	const float sinPhi = (float)terms->sinPhi;
+	const float cosPhi = (float)terms->cosPhi;
+	const float xScale = (float)terms->xScale;
+	const float yScale = (float)terms->yScale;
+	const float thetaMag = (float)terms->thetaMag;
+	const float phiMagCos = (float)terms->phiMagCos;
+	const float phiMagSin = (float)terms->phiMagSin;
+	const float eThetaScale = (float)(1.0 / eThetaElement);
+	const float ePhiScale = (float)(1.0 / ePhiElement);
+	float maxModVal = 0.0f;
+	uint16_t loopCount = first;
+
+#ifdef USE_NEON_KERNELS
+	float32x4_t maxVec = vdupq_n_f32(0.0f);
+	float modReal[4] __attribute__((aligned(16)));
+	float waveRe[4] __attribute__((aligned(16)));
+	float waveIm[4] __attribute__((aligned(16)));
+	uint8_t lane;
+	for (; loopCount + 4 <= last; loopCount += 4) {
+		float32x4_t rotCos = vld1q_f32(&cellGeometryF32.rotCos[loopCount]);
+		float32x4_t rotSin = vld1q_f32(&cellGeometryF32.rotSin[loopCount]);
+		float32x4_t eTheta = vmulq_f32(vaddq_f32(
+				vmulq_f32(vdupq_n_f32(sinPhi), rotCos),
+				vmulq_f32(vdupq_n_f32(cosPhi), rotSin)),
+				vdupq_n_f32(eThetaScale));
+		float32x4_t ePhi = vmulq_f32(vsubq_f32(
+				vmulq_f32(vdupq_n_f32(cosPhi), rotCos),
+				vmulq_f32(vdupq_n_f32(sinPhi), rotSin)),
+				vdupq_n_f32(ePhiScale));
+		float32x4_t weightReal = vaddq_f32(
+				vmulq_f32(vdupq_n_f32(thetaMag), eTheta),
+				vmulq_f32(vdupq_n_f32(phiMagCos), ePhi));
+		float32x4_t weightImag = vmulq_f32(vdupq_n_f32(phiMagSin), ePhi);
+		float32x4_t angle = vaddq_f32(vaddq_f32(
+				vld1q_f32(&cellGeometryF32.waveInAngle[loopCount]),
+				vmulq_f32(vld1q_f32(&cellGeometryF32.x[loopCount]),
+						vdupq_n_f32(xScale))),
+				vmulq_f32(vld1q_f32(&cellGeometryF32.y[loopCount]),
+						vdupq_n_f32(yScale)));
+		float32x4_t sinVal;
+		float32x4_t cosVal;
+		sinCosF32x4(angle, &sinVal, &cosVal);
+		float32x4_t modulation = vsubq_f32(vmulq_f32(cosVal, weightReal),
+				vmulq_f32(sinVal, weightImag));
+		maxVec = vmaxq_f32(maxVec, vabsq_f32(modulation));
+		vst1q_f32(modReal, modulation);
+		vst1q_f32(waveRe, cosVal);
+		vst1q_f32(waveIm, sinVal);
+		for (lane = 0; lane < 4; ++lane) {
+			modulationReal[loopCount + lane] = modReal[lane];
+			lastPointing.waveRe[loopCount + lane] = waveRe[lane];
+			lastPointing.waveIm[loopCount + lane] = waveIm[lane];
+		}
+	}
+	float32x2_t maxPair = vpmax_f32(vget_low_f32(maxVec),
+			vget_high_f32(maxVec));
+	maxPair = vpmax_f32(maxPair, maxPair);
+	maxModVal = vget_lane_f32(maxPair, 0);
+#endif
+
+	for (; loopCount < last; ++loopCount) {
+		float rotCos = cellGeometryF32.rotCos[loopCount];
+		float rotSin = cellGeometryF32.rotSin[loopCount];
+		float eTheta = (sinPhi * rotCos + cosPhi * rotSin) * eThetaScale;
+		float ePhi = (cosPhi * rotCos - sinPhi * rotSin) * ePhiScale;
+		float weightReal = thetaMag * eTheta + phiMagCos * ePhi;
+		float weightImag = phiMagSin * ePhi;
+		float angle = (cellGeometryF32.waveInAngle[loopCount]
+				+ cellGeometryF32.x[loopCount] * xScale)
+				+ cellGeometryF32.y[loopCount] * yScale;
+		float sinVal;
+		float cosVal;
+		sinCosF32(angle, &sinVal, &cosVal);
+		float modulation = cosVal * weightReal - sinVal * weightImag;
+		float tempMaxVal = fabsf(modulation);
+		maxModVal = (maxModVal > tempMaxVal ? maxModVal : tempMaxVal);
+		modulationReal[loopCount] = modulation;
+		lastPointing.waveRe[loopCount] = cosVal;
+		lastPointing.waveIm[loopCount] = sinVal;
+	}
+	return maxModVal;
+}
+
+/*****************************************************************************
+*
+* function calcWaveKernelFixed()
+*
+* - fixed point wave equation kernel, same factoring as calcWaveKernelF32()
+* - each cell's phase, ks * rhoRound plus the outgoing wave angle, is
+*   accumulated as a 32 bit fraction of a turn, so the modulo 2 pi reduction
+*   is free integer wraparound and sin/cos come from a Q15 table indexed by
+*   the top SINE_TABLE_BITS bits
+* - the per-cell work is integer only and gives the same result on every
+*   target, the shared steering terms are still computed once per call with
+*   libm
+* - returns:	largest magnitude of the real modulation in the range
+*
+*****************************************************************************/
+static double calcWaveKernelFixed(const steeringTerms* terms,
+		uint16_t first, uint16_t last)
+{
+	const uint32_t tableShift = 32 - SINE_TABLE_BITS;
+	const uint32_t tableRound = 1u << (tableShift - 1);
+	const uint32_t tableMask = SINE_TABLE_SIZE - 1;
+	const uint32_t quarterTurn = SINE_TABLE_SIZE / 4;
+
+	// outgoing wave in turns per meter, Q8.24, and phi in turns
+	const int64_t xScale = llround(ldexp(terms->xScale / (2.0 * M_PI), 24));
+	const int64_t yScale = llround(ldexp(terms->yScale / (2.0 * M_PI), 24));
+	const uint32_t phiTurns = angleToTurns(terms->phiTurns);
+
+	// polarization weights with the element scaling folded in, Q15
+	const int64_t thetaWeight = llround(ldexp(terms->thetaMag
+			/ eThetaElement, 15));
+	const int64_t phiWeightCos = llround(ldexp(terms->phiMagCos
+			/ ePhiElement, 15));
+	const int64_t phiWeightSin = llround(ldexp(terms->phiMagSin
+			/ ePhiElement, 15));
+
+	int64_t maxModVal = 0;
+	uint16_t loopCount;
+	for (loopCount = first; loopCount < last; ++loopCount) {
+		// sin(phi + rot) and cos(phi + rot)
+		uint32_t rotIndex = ((phiTurns + cellGeometryFixed.rotTurns[loopCount]
+				+ tableRound) >> tableShift) & tableMask;
+		int64_t eTheta = sineTableQ15[rotIndex];
+		int64_t ePhi = sineTableQ15[(rotIndex + quarterTurn) & tableMask];
+		int64_t weightReal = (thetaWeight * eTheta + phiWeightCos * ePhi)
+				>> 15;
+		int64_t weightImag = (phiWeightSin * ePhi) >> 15;
+
+		// Q16.48 turns, wrapped to Q0.32 by the truncation
+		uint32_t angle = cellGeometryFixed.waveInTurns[loopCount]
+				+ (uint32_t)((cellGeometryFixed.x[loopCount] * xScale
+						+ cellGeometryFixed.y[loopCount] * yScale) >> 16);
+		uint32_t angleIndex = ((angle + tableRound) >> tableShift)
+				& tableMask;
+		int64_t sinVal = sineTableQ15[angleIndex];
+		int64_t cosVal = sineTableQ15[(angleIndex + quarterTurn) & tableMask];
+
+		// Q30
+		int64_t modulation = cosVal * weightReal - sinVal * weightImag;
+		int64_t tempMaxVal = (modulation < 0 ? -modulation : modulation);
+		maxModVal = (maxModVal > tempMaxVal ? maxModVal : tempMaxVal);
+		modulationReal[loopCount] = ldexp((double)modulation, -30);
+		lastPointing.waveRe[loopCount] = ldexp((double)cosVal, -15);
+		lastPointing.waveIm[loopCount] = ldexp((double)sinVal, -15);
+	}
+	return ldexp((double)maxModVal, -30);
+}
+
+/*****************************************************************************
+*
+* function setWaveModulationKernel()
+*
+* - select the kernel used by calcWaveModulation()
+* - returns:	0 on success, -1 if the kernel name is not recognized
+*
+*****************************************************************************/
+int setWaveModulationKernel(const char* kernelName)
+{
+	waveKernel kernel;
+	if (!strcmp(kernelName, "double")) {
+		kernel = calcWaveKernelDouble;
+	}
+	else if (!strcmp(kernelName, "float32")) {
+		kernel = calcWaveKernelF32;
+	}
+	else if (!strcmp(kernelName, "fixed point")) {
+		kernel = calcWaveKernelFixed;
+	}
+	else {
+		printf("Unknown wave modulation kernel: %s\n", kernelName);
+		return -1;
+	}
+
+	// cached patterns were made by the old kernel
+	if (kernel != activeWaveKernel) {
+		activeWaveKernel = kernel;
+		clearPatternCache();
+	}
+	return 0;
+}
+
+/*****************************************************************************
+*
+* function quantizeModulation()
+*
+* - map a real modulation value to a gray shade level, normalized by the
+*   largest magnitude over all cells
+* - returns:	the gray shade level
+*
+*****************************************************************************/
+static inline uint32_t quantizeModulation(double modulationValue,
+		double maxModVal)
+{
+	double modulationTemp = pow(((modulationValue + maxModVal)
+									/ (2.0 * maxModVal)), modPower);
+	modulationTemp *= (grayShades - 1);
+	return (uint32_t)(floor(modulationTemp / (grayShades - 1)));
+}
+
+/*****************************************************************************
+*
+* function waveSliceStart()
+*
+* - first cell of a slice of the per-cell loops, slices are split on 4 cell
+*   boundaries so the NEON loop of every slice stays full
+* - returns:	index of the first cell, ACTV_CELLS for the slice past the end
+*
+*****************************************************************************/
+static uint16_t waveSliceStart(uint8_t slice)
+{
+	uint32_t numSlices = wavePool.numWorkers + 1;
+	return (uint16_t)((ACTV_CELLS / 4) * slice / numSlices * 4
+			+ (slice == numSlices ? ACTV_CELLS % 4 : 0));
+}
+
+/*****************************************************************************
+*
+* function waveWorkerThread()
+*
+* - body of a pool thread, sleeps until a job is posted, runs its slice and
+*   reports back, until stopWaveWorkers() is called
+* - returns:	NULL
+*
+*****************************************************************************/
+static void* waveWorkerThread(void* arg)
+{
+	uint8_t slice = (uint8_t)(uintptr_t)arg;
+	uint32_t seenGeneration = 0;
+	waveJob job;
+
+	pthread_mutex_lock(&wavePool.lock);
+	for (;;) {
+		while (!wavePool.stopping && wavePool.generation == seenGeneration) {
+			pthread_cond_wait(&wavePool.jobReady, &wavePool.lock);
+		}
+		if (wavePool.stopping) {
+			break;
+		}
+		seenGeneration = wavePool.generation;
+		job = wavePool.job;
+		pthread_mutex_unlock(&wavePool.lock);
+
+		job(waveSliceStart(slice), waveSliceStart(slice + 1), slice);
+
+		pthread_mutex_lock(&wavePool.lock);
+		if (--wavePool.pending == 0) {
+			pthread_cond_signal(&wavePool.jobDone);
+		}
+	}
+	pthread_mutex_unlock(&wavePool.lock);
+	return NULL;
+}
+
+/*****************************************************************************
+*
+* function runWaveJob()
+*
+* - run a job over all active cells, split across the pool when it is
+*   running, the calling thread works on slice 0 and then waits for the rest
+* - returns:	none
+*
+*****************************************************************************/
+static void runWaveJob(waveJob job)
+{
+	if (wavePool.numWorkers == 0) {
+		job(0, ACTV_CELLS, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&wavePool.lock);
+	wavePool.job = job;
+	wavePool.pending = wavePool.numWorkers;
+	++wavePool.generation;
+	pthread_cond_broadcast(&wavePool.jobReady);
+	pthread_mutex_unlock(&wavePool.lock);
+
+	job(waveSliceStart(0), waveSliceStart(1), 0);
+
+	pthread_mutex_lock(&wavePool.lock);
+	while (wavePool.pending > 0) {
+		pthread_cond_wait(&wavePool.jobDone, &wavePool.lock);
+	}
+	pthread_mutex_unlock(&wavePool.lock);
+}
+
+static void waveKernelJob(uint16_t first, uint16_t last, uint8_t slice)
+{
+	wavePool.partialMax[slice] = activeWaveKernel(wavePool.terms, first, last);
+}
+
+static void waveQuantizeJob(uint16_t first, uint16_t last, uint8_t slice)
+{
+	uint16_t loopCount;
+	for (loopCount = first; loopCount < last; ++ loopCount) {
+		modulationWave[loopCount] = quantizeModulation(
+				modulationReal[loopCount], wavePool.maxModVal);
+
+		// map to modulation array mask...
+
+		// for each row, column pair, write a 1 into the mask matrix
+		waveModMask[kdkRowBitMask[loopCount] * numCols +
+					kdkColumnBitMask[loopCount]] = modulationWave[loopCount];
+	}
+}
+
+/*****************************************************************************
+*
+* function reduceWaveMax()
+*
+* - combine the partial maxima left by the slices of the last job
+* - returns:	largest partial maximum
+*
+*****************************************************************************/
+static double reduceWaveMax(void)
+{
+	double maxModVal = 0.0;
+	uint8_t slice;
+	for (slice = 0; slice <= wavePool.numWorkers; ++slice) {
+		maxModVal = (maxModVal > wavePool.partialMax[slice] ?
+				maxModVal : wavePool.partialMax[slice]);
+	}
+	return maxModVal;
+}
+
+/*****************************************************************************
+*
+* function runWaveKernel()
+*
+* - run the active wave kernel over all active cells, on the pool when it is
+*   running, and reduce the partial maxima of the slices
+* - returns:	largest magnitude of the real modulation
+*
+*****************************************************************************/
+static double runWaveKernel(const steeringTerms* terms)
+{
+	uint64_t stageStart = startStageTimer();
+	wavePool.terms = terms;
+	runWaveJob(waveKernelJob);
+	lastPointing.sinPhi = terms->sinPhi;
+	lastPointing.cosPhi = terms->cosPhi;
+	lastPointing.valid = true;
+	double maxModVal = reduceWaveMax();
+	stopStageTimer(STAGE_WAVE_COMPUTE, stageStart);
+	return maxModVal;
+}
+
+/*****************************************************************************
+*
+* function startWaveWorkers()
+*
+* - start the persistent worker threads used by the wave calculations
+* - returns:	0 on success, -1 on failure
+*
+*****************************************************************************/
+int startWaveWorkers(uint8_t numWorkers)
+{
+	if (wavePool.numWorkers != 0 || numWorkers == 0
+			|| numWorkers > MAX_WAVE_WORKERS) {
+		printf("ERROR: cannot start %u wave workers...\n", numWorkers);
+		return -1;
+	}
+
+	wavePool.generation = 0;
+	wavePool.stopping = false;
+	uint8_t workerCount;
+	for (workerCount = 0; workerCount < numWorkers; ++workerCount) {
+		if (pthread_create(&wavePool.threads[workerCount], NULL,
+				waveWorkerThread, (void*)(uintptr_t)(workerCount + 1)) != 0) {
+			printf("ERROR: pthread_create() failed...\n");
+			wavePool.numWorkers = workerCount;
+			stopWaveWorkers();
+			return -1;
+		}
+	}
+	wavePool.numWorkers = numWorkers;
+
+	return 0;
+}
+
+/*****************************************************************************
+*
+* function stopWaveWorkers()
+*
+* - stop and join the worker threads, the wave calculations run on the
+*   calling thread again afterwards
+* - returns:	none
+*
+*****************************************************************************/
+void stopWaveWorkers(void)
+{
+	pthread_mutex_lock(&wavePool.lock);
+	wavePool.stopping = true;
+	pthread_cond_broadcast(&wavePool.jobReady);
+	pthread_mutex_unlock(&wavePool.lock);
+
+	uint8_t workerCount;
+	for (workerCount = 0; workerCount < wavePool.numWorkers; ++workerCount) {
+		pthread_join(wavePool.threads[workerCount], NULL);
+	}
+	wavePool.numWorkers = 0;
+	wavePool.stopping = false;
+}
+
+/*****************************************************************************
+*
+* function calcWaveModulation()
+*
+* - calculate the modulation matrix using the wave equation and hardware
+*   parameters
+* - calculations follow those implemented in:
+* 		mtennaLib->Viking2.py->calculate_modulation()
+* - the per-cell work is done by the kernel chosen with
+*   setWaveModulationKernel(), split across the worker threads when
+*   startWaveWorkers() has been called
+* - arguments:	3 angles normally determined by antenna control algorithms
+* - returns:	none
+*
+*****************************************************************************/
+void calcWaveModulation(double theta, double phi, double phase)
+{
+	steeringTerms terms;
+
+	initCellGeometry();
+	calcSteeringTerms(theta, phi, phase, &terms);
+	wavePool.maxModVal = runWaveKernel(&terms);
+	uint64_t stageStart = startStageTimer();
+	runWaveJob(waveQuantizeJob);
+	stopStageTimer(STAGE_QUANTIZE, stageStart);
+
+	// output data for comparison with Python generated values...
+	traceMatrix(TRACE_WAVE_MODULATION, waveModMask,
+			"waveModulationMatrix.csv");
+}
+
+/*****************************************************************************
+ *
+ * Compare two cell pack table entries, by word and then by cell so the
+ * sort order does not depend on qsort().
+ *
+ ****************************************************************************/
+static int compareCellPackEntries(const void* first, const void* second)
+{
+	const cellPackEntry* firstEntry = (const cellPackEntry*)first;
+	const cellPackEntry* secondEntry = (const cellPackEntry*)second;
+	if (firstEntry->word != secondEntry->word) {
+		return (firstEntry->word < secondEntry->word ? -1 : 1);
+	}
+	return (int)firstEntry->cell - (int)secondEntry->cell;
+}
+
+/*****************************************************************************
+ *
+ * Fuse the active cell row and column masks with the column bitmap tables
+ * into one table of pattern word and bit mask per active cell, sorted by
+ * word.  Only does the work on the first call.
+ *
+ ****************************************************************************/
+static void initCellPacking(void)
+{
+	if (cellPackTableValid) {
+		return;
+	}
+
+	uint16_t loopCount;
+	uint8_t colCount;
+	uint8_t rowCount;
+	for (loopCount = 0; loopCount < ACTV_CELLS; ++loopCount) {
+		colCount = kdkColumnBitMask[loopCount];
+		rowCount = kdkRowBitMask[loopCount];
+		cellPackTable[loopCount].word = byteOffsetsByColumn[colCount]
+				+ rowCount * rowGroupSize;
+		cellPackTable[loopCount].cell = loopCount;
+		cellPackTable[loopCount].matrixIndex = rowCount * numCols + colCount;
+		cellPackTable[loopCount].mask = 1u
+				<< (byteStartingBitValuesByColumn[colCount]
+					+ bitShiftValueByColumn[colCount]);
+	}
+	qsort(cellPackTable, ACTV_CELLS, sizeof(cellPackEntry),
+			compareCellPackEntries);
+	cellPackTableValid = true;
+}
+
+/*****************************************************************************
+ *
+ * Pack one level per active cell, in kdkRowBitMask / kdkColumnBitMask
+ * order, into the pattern buffer layout.  A cell's bit is set when its
+ * level is 1, as in formatAndWriteModulationToFPGAKDKFromScratch().  One
+ * linear pass over the sorted table, each word is stored once.
+ *
+ ****************************************************************************/
+static void packCellLevels(const uint8_t* levels, uint32_t* packedPattern)
+{
+	initCellPacking();
+
+	uint64_t stageStart = startStageTimer();
+	memset(packedPattern, 0, BUF_SIZE * sizeof(uint32_t));
+	const cellPackEntry* entry = cellPackTable;
+	const cellPackEntry* tableEnd = cellPackTable + ACTV_CELLS;
+	while (entry < tableEnd) {
+		uint16_t word = entry->word;
+		uint32_t wordValue = 0;
+		for (; entry < tableEnd && entry->word == word; ++entry) {
+			wordValue |= entry->mask & -(uint32_t)(levels[entry->cell] == 1);
+		}
+		packedPattern[word] = wordValue;
+	}
+	stopStageTimer(STAGE_PACK, stageStart);
+}
+
+/*****************************************************************************
+ *
+ * Pack modulationBuffer into the pattern buffer layout.  Positions outside
+ * the active cells are always 0 in modulationBuffer, so only the active
+ * cells need visiting.
+ *
+ ****************************************************************************/
+static void packModulationBuffer(uint32_t* packedPattern)
+{
+	initCellPacking();
+
+	uint64_t stageStart = startStageTimer();
+	memset(packedPattern, 0, BUF_SIZE * sizeof(uint32_t));
+	const cellPackEntry* entry = cellPackTable;
+	const cellPackEntry* tableEnd = cellPackTable + ACTV_CELLS;
+	for (; entry < tableEnd; ++entry) {
+		if (modulationBuffer[entry->matrixIndex] == 1) {
+			packedPattern[entry->word] |= entry->mask;
+		}
+	}
+	stopStageTimer(STAGE_PACK, stageStart);
+}
+
+/*****************************************************************************
+ *
+ * Pack a cell bitmap of CELL_BITMAP_BYTES into the pattern buffer layout.
+ * Bit n, counted LSB first from byte 0, is active cell n in kdkRowBitMask /
+ * kdkColumnBitMask order.
+ *
+ ****************************************************************************/
+void packCellBitmap(const uint8_t* cellBitmap, uint32_t* packedPattern)
+{
+	initCellPacking();
+
+	uint64_t stageStart = startStageTimer();
+	memset(packedPattern, 0, BUF_SIZE * sizeof(uint32_t));
+	const cellPackEntry* entry = cellPackTable;
+	const cellPackEntry* tableEnd = cellPackTable + ACTV_CELLS;
+	while (entry < tableEnd) {
+		uint16_t word = entry->word;
+		uint32_t wordValue = 0;
+		for (; entry < tableEnd && entry->word == word; ++entry) {
+			uint32_t cellBit = (cellBitmap[entry->cell >> 3]
+					>> (entry->cell & 7)) & 1;
+			wordValue |= entry->mask & -cellBit;
+		}
+		packedPattern[word] = wordValue;
+	}
+	stopStageTimer(STAGE_PACK, stageStart);
+}
+
+/*****************************************************************************
+ *
+ * Re-code from scratch... using the spreadsheet as guide
+ *
+ * assume the pattern buffer has been zero initialized
+ * placement algorithm repeats for each row
+ *
+ * the bit to set is either byte1 plus offset or byte3 + offset
+ * byte0 and byte2 are unused and stay all 0
+ * so:
+ * 		start of byte1 == 8, start of byte3 == 24
+ *
+ *	the pattern buffer index value is byte offset + row * 10
+ *
+ * 	for each row
+ * 		set each word value to zero
+ * 		for each column
+ * 			get byte and offset value from array in include header
+ * 			if modulation [row][col] == 1
+ * 				index into the correct word in the pattern buffer
+ *				set bit correspond to bit position = byte value + offset
+ *
+ ****************************************************************************/
+void formatAndWriteModulationToFPGAKDKFromScratch(void)
+{
+	packModulationBuffer(zeroBuffer);
+	traceWords(TRACE_DESIRED_PATTERN, zeroBuffer, numRows * rowGroupSize,
+			"desiredPatternBuffer.csv");
+	writePackedPatternToFPGA(zeroBuffer);
+	verifyCommittedPattern(zeroBuffer);
+}
+
+/*****************************************************************************
+ *
+ * Quantize the real modulation left in modulationReal[] by the wave kernel
+ * and set the pattern bit of every cell that is on.
+ *
+ ****************************************************************************/
+static void packModulationReal(double maxModVal, uint32_t* packedPattern)
+{
+	uint16_t loopCount;
+	uint64_t stageStart = startStageTimer();
+	for (loopCount = 0; loopCount < ACTV_CELLS; ++loopCount) {
+		cellLevel[loopCount] = (quantizeModulation(modulationReal[loopCount],
+				maxModVal) == 1);
+	}
+	stopStageTimer(STAGE_QUANTIZE, stageStart);
+	packCellLevels(cellLevel, packedPattern);
+}
+
+/*****************************************************************************
+ *
+ * Fused steering entry point, goes from the steering angles straight to the
+ * pattern buffer layout written by
+ * formatAndWriteModulationToFPGAKDKFromScratch().
+ *
+ * The wave kernel writes the real modulation of each active cell, then a
+ * single pass quantizes each cell and sets its bit in the packed pattern,
+ * skipping the modulation matrices and the dense 105 x 158 packing walk.
+ *
+ ****************************************************************************/
+void steerAndPack(double theta, double phi, double phase,
+		uint32_t* packedPattern)
+{
+	steeringTerms terms;
+
+	initCellGeometry();
+	calcSteeringTerms(theta, phi, phase, &terms);
+	packModulationReal(runWaveKernel(&terms),
+			packedPattern);
+}
+
+/*****************************************************************************
+ *
+ * Batch version of steerAndPack(), packs one pattern per angle triple into
+ * consecutive BUF_SIZE word blocks of packedPatterns.
+ *
+ * The geometry cache and the wave numbers are set up once for the whole
+ * batch, each pointing only pays for its own steering terms.
+ *
+ ****************************************************************************/
+void steerAndPackBatch(const double* angles, uint32_t count,
+		uint32_t* packedPatterns)
+{
+	steeringTerms terms;
+	uint32_t patternCount;
+
+	initCellGeometry();
+	for (patternCount = 0; patternCount < count; ++patternCount) {
+		const double* triple = angles + 3 * patternCount;
+		calcSteeringTerms(triple[0], triple[1], triple[2], &terms);
+		packModulationReal(runWaveKernel(&terms),
+				packedPatterns + patternCount * BUF_SIZE);
+	}
+}
+
+/*****************************************************************************
+ *
+ * Sweep jobs, run through the worker pool like the wave kernels.
+ *
+ * The setup job computes the per-cell weights and rotors once per sweep, the
+ * seed job sets the per-cell wave exactly from sin/cos at
+ * waveSweep.seedSinTheta, the step job writes the real modulation of the
+ * current step and rotates every cell's wave on to the next step.
+ *
+ ****************************************************************************/
+static void waveSweepSetupJob(uint16_t first, uint16_t last, uint8_t slice)
+{
+	const steeringTerms* terms = &waveSweep.terms;
+	double stepScale = kf * waveSweep.sinThetaStep;
+	double eTheta;
+	double ePhi;
+	double rotorAngle;
+	uint16_t loopCount;
+
+	for (loopCount = first; loopCount < last; ++loopCount) {
+		eTheta = (terms->sinPhi * cellGeometry.rotCos[loopCount]
+				+ terms->cosPhi * cellGeometry.rotSin[loopCount])
+				* (1.0 / eThetaElement);
+		ePhi = (terms->cosPhi * cellGeometry.rotCos[loopCount]
+				- terms->sinPhi * cellGeometry.rotSin[loopCount])
+				* (1.0 / ePhiElement);
+		waveSweep.weightRe[loopCount] = terms->thetaMag * eTheta
+				+ terms->phiMagCos * ePhi;
+		waveSweep.weightIm[loopCount] = terms->phiMagSin * ePhi;
+
+		rotorAngle = stepScale * (kdkXGeoVal[loopCount] * terms->cosPhi
+				+ kdkYGeoVal[loopCount] * terms->sinPhi);
+		waveSweep.rotorRe[loopCount] = cos(rotorAngle);
+		waveSweep.rotorIm[loopCount] = sin(rotorAngle);
+	}
+}
+
+static void waveSweepSeedJob(uint16_t first, uint16_t last, uint8_t slice)
+{
+	const steeringTerms* terms = &waveSweep.terms;
+	double angleScale = kf * waveSweep.seedSinTheta;
+	double waveOutAngle;
+	double waveOutRe;
+	double waveOutIm;
+	uint16_t loopCount;
+
+	for (loopCount = first; loopCount < last; ++loopCount) {
+		waveOutAngle = angleScale * (kdkXGeoVal[loopCount] * terms->cosPhi
+				+ kdkYGeoVal[loopCount] * terms->sinPhi);
+		waveOutRe = cos(waveOutAngle);
+		waveOutIm = sin(waveOutAngle);
+		waveSweep.waveRe[loopCount] =
+				cellGeometry.waveInReal[loopCount] * waveOutRe
+				- cellGeometry.waveInImag[loopCount] * waveOutIm;
+		waveSweep.waveIm[loopCount] =
+				cellGeometry.waveInReal[loopCount] * waveOutIm
+				+ cellGeometry.waveInImag[loopCount] * waveOutRe;
+	}
+}
+
+static void waveSweepStepJob(uint16_t first, uint16_t last, uint8_t slice)
+{
+	double waveRe;
+	double waveIm;
+	double modulation;
+	double tempMaxVal;
+	double maxModVal = 0.0;
+	uint16_t loopCount;
+
+	for (loopCount = first; loopCount < last; ++loopCount) {
+		waveRe = waveSweep.waveRe[loopCount];
+		waveIm = waveSweep.waveIm[loopCount];
+		modulation = waveRe * waveSweep.weightRe[loopCount]
+				- waveIm * waveSweep.weightIm[loopCount];
+		tempMaxVal = fabs(modulation);
+		maxModVal = (maxModVal > tempMaxVal ? maxModVal : tempMaxVal);
+		modulationReal[loopCount] = modulation;
+		lastPointing.waveRe[loopCount] = waveRe;
+		lastPointing.waveIm[loopCount] = waveIm;
+
+		waveSweep.waveRe[loopCount] = waveRe * waveSweep.rotorRe[loopCount]
+				- waveIm * waveSweep.rotorIm[loopCount];
+		waveSweep.waveIm[loopCount] = waveRe * waveSweep.rotorIm[loopCount]
+				+ waveIm * waveSweep.rotorRe[loopCount];
+	}
+	wavePool.partialMax[slice] = maxModVal;
+}
+
+/*****************************************************************************
+ *
+ * Start an incremental sweep at theta, for a fixed phi and phase, that
+ * advances sin(theta) by sinThetaStep on every call to
+ * nextWaveSweepPattern().
+ *
+ * The per-cell waves are recomputed exactly every reseedInterval steps, 0
+ * selects DEFAULT_SWEEP_RESEED_INTERVAL, to bound the rounding drift of the
+ * rotor products.
+ *
+ * Returns 0 on success, -1 if theta is outside +/- 90 degrees.
+ *
+ ****************************************************************************/
+int beginWaveSweep(double theta, double phi, double phase,
+		double sinThetaStep, uint16_t reseedInterval)
+{
+	if (fabs(theta) > 90.0) {
+		printf("ERROR: sweep start theta %f out of range...\n", theta);
+		return -1;
+	}
+
+	initCellGeometry();
+	calcSteeringTerms(theta, phi, phase, &waveSweep.terms);
+	waveSweep.phase = phase * (pi / 180.0);
+	waveSweep.startSinTheta = sin(theta * (pi / 180.0));
+	waveSweep.sinThetaStep = sinThetaStep;
+	waveSweep.stepCount = 0;
+	waveSweep.reseedInterval = (reseedInterval == 0 ?
+			DEFAULT_SWEEP_RESEED_INTERVAL : reseedInterval);
+	runWaveJob(waveSweepSetupJob);
+	waveSweep.active = true;
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Pack the pattern for the current sweep step into packedPattern and advance
+ * the sweep by one step.
+ *
+ * Returns 0 on success, -1 if no sweep is active or the sweep has left the
+ * visible region, |sin(theta)| > 1.
+ *
+ ****************************************************************************/
+int nextWaveSweepPattern(uint32_t* packedPattern)
+{
+	if (!waveSweep.active) {
+		return -1;
+	}
+
+	// the nominal angle is not accumulated, so it does not drift
+	double sinTheta = waveSweep.startSinTheta
+			+ waveSweep.stepCount * waveSweep.sinThetaStep;
+	if (fabs(sinTheta) > 1.0) {
+		waveSweep.active = false;
+		return -1;
+	}
+
+	uint64_t stageStart = startStageTimer();
+	if (waveSweep.stepCount % waveSweep.reseedInterval == 0) {
+		waveSweep.seedSinTheta = sinTheta;
+		runWaveJob(waveSweepSeedJob);
+	}
+	runWaveJob(waveSweepStepJob);
+	lastPointing.sinPhi = waveSweep.terms.sinPhi;
+	lastPointing.cosPhi = waveSweep.terms.cosPhi;
+	lastPointing.valid = true;
+	double maxModVal = reduceWaveMax();
+	stopStageTimer(STAGE_WAVE_COMPUTE, stageStart);
+	packModulationReal(maxModVal, packedPattern);
+	++waveSweep.stepCount;
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Polarization job, recombines the theta and phi components of the last
+ * pointing with the weights in wavePool.terms.
+ *
+ ****************************************************************************/
+static void polarizationJob(uint16_t first, uint16_t last, uint8_t slice)
+{
+	const steeringTerms* terms = wavePool.terms;
+	double eTheta;
+	double ePhi;
+	double modulation;
+	double tempMaxVal;
+	double maxModVal = 0.0;
+	uint16_t loopCount;
+
+	for (loopCount = first; loopCount < last; ++loopCount) {
+		eTheta = (terms->sinPhi * cellGeometry.rotCos[loopCount]
+				+ terms->cosPhi * cellGeometry.rotSin[loopCount])
+				* (1.0 / eThetaElement);
+		ePhi = (terms->cosPhi * cellGeometry.rotCos[loopCount]
+				- terms->sinPhi * cellGeometry.rotSin[loopCount])
+				* (1.0 / ePhiElement);
+		modulation = lastPointing.waveRe[loopCount]
+				* (terms->thetaMag * eTheta + terms->phiMagCos * ePhi)
+				- lastPointing.waveIm[loopCount] * (terms->phiMagSin * ePhi);
+		tempMaxVal = fabs(modulation);
+		maxModVal = (maxModVal > tempMaxVal ? maxModVal : tempMaxVal);
+		modulationReal[loopCount] = modulation;
+	}
+	wavePool.partialMax[slice] = maxModVal;
+}
+
+/*****************************************************************************
+ *
+ * Change the polarization of the last pointing.  The new linear
+ * polarization angle is kept for later pointings, including the remaining
+ * steps of an active sweep, the phase only applies to this recombination.
+ *
+ * Returns the largest magnitude of the recombined real modulation, or -1.0
+ * if there is no pointing to recombine, none was calculated yet or the last
+ * pattern came from the pattern cache or the beam codebook.
+ *
+ ****************************************************************************/
+static double recombinePolarization(double phase, double polAngle)
+{
+	steeringTerms terms;
+
+	if (!lastPointing.valid) {
+		printf("ERROR: no pointing to change the polarization of...\n");
+		return -1.0;
+	}
+
+	polAngle *= (pi / 180.0);
+	phase *= (pi / 180.0);
+	polThetaMag = cos(polAngle);
+	polPhiMag = sin(polAngle);
+	polAngleDegrees = atan2(polPhiMag, polThetaMag) * (180.0 / pi);
+	clearPatternCache();
+
+	if (waveSweep.active) {
+		waveSweep.terms.thetaMag = polThetaMag;
+		waveSweep.terms.phiMagCos = polPhiMag * cos(waveSweep.phase);
+		waveSweep.terms.phiMagSin = polPhiMag * sin(waveSweep.phase);
+		runWaveJob(waveSweepSetupJob);
+	}
+
+	terms.sinPhi = lastPointing.sinPhi;
+	terms.cosPhi = lastPointing.cosPhi;
+	terms.thetaMag = polThetaMag;
+	terms.phiMagCos = polPhiMag * cos(phase);
+	terms.phiMagSin = polPhiMag * sin(phase);
+	uint64_t stageStart = startStageTimer();
+	wavePool.terms = &terms;
+	runWaveJob(polarizationJob);
+	double maxModVal = reduceWaveMax();
+	stopStageTimer(STAGE_WAVE_COMPUTE, stageStart);
+
+	return maxModVal;
+}
+
+/*****************************************************************************
+ *
+ * Recombine the last pointing for a new phase and polarization angle and
+ * update the wave modulation matrix, as calcWaveModulation() does.
+ *
+ * Returns 0 on success, -1 if no pointing has been calculated yet.
+ *
+ ****************************************************************************/
+int setPolarization(double phase, double polAngle)
+{
+	double maxModVal = recombinePolarization(phase, polAngle);
+	if (maxModVal < 0.0) {
+		return -1;
+	}
+
+	wavePool.maxModVal = maxModVal;
+	uint64_t stageStart = startStageTimer();
+	runWaveJob(waveQuantizeJob);
+	stopStageTimer(STAGE_QUANTIZE, stageStart);
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Recombine the last pointing for a new phase and polarization angle and
+ * pack the result, as steerAndPack() does.
+ *
+ * Returns 0 on success, -1 if no pointing has been calculated yet.
+ *
+ ****************************************************************************/
+int setPolarizationAndPack(double phase, double polAngle,
+		uint32_t* packedPattern)
+{
+	double maxModVal = recombinePolarization(phase, polAngle);
+	if (maxModVal < 0.0) {
+		return -1;
+	}
+
+	packModulationReal(maxModVal, packedPattern);
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Pattern cache helpers, hash a quantized key and unlink or push an entry
+ * in the recency list.
+ *
+ ****************************************************************************/
+static uint32_t patternCacheHash(const int32_t* key)
+{
+	uint32_t hash = 2166136261u;
+	uint8_t keyCount;
+	for (keyCount = 0; keyCount < 3; ++keyCount) {
+		hash = (hash ^ (uint32_t)key[keyCount]) * 16777619u;
+		hash ^= hash >> 15;
+	}
+	return hash & patternCache.hashMask;
+}
+
+static void patternCacheUnlink(uint32_t index)
+{
+	patternCacheEntry* entry = &patternCache.entries[index];
+	if (entry->prev != PATTERN_CACHE_NONE) {
+		patternCache.entries[entry->prev].next = entry->next;
+	}
+	else {
+		patternCache.head = entry->next;
+	}
+	if (entry->next != PATTERN_CACHE_NONE) {
+		patternCache.entries[entry->next].prev = entry->prev;
+	}
+	else {
+		patternCache.tail = entry->prev;
+	}
+}
+
+static void patternCachePushFront(uint32_t index)
+{
+	patternCacheEntry* entry = &patternCache.entries[index];
+	entry->prev = PATTERN_CACHE_NONE;
+	entry->next = patternCache.head;
+	if (patternCache.head != PATTERN_CACHE_NONE) {
+		patternCache.entries[patternCache.head].prev = index;
+	}
+	patternCache.head = index;
+	if (patternCache.tail == PATTERN_CACHE_NONE) {
+		patternCache.tail = index;
+	}
+}
+
+/*****************************************************************************
+ *
+ * Evict the least recently used entry and return its index for reuse.
+ *
+ ****************************************************************************/
+static uint32_t patternCacheEvict(void)
+{
+	uint32_t index = patternCache.tail;
+	uint32_t* link = &patternCache.hashHeads[
+			patternCacheHash(patternCache.entries[index].key)];
+	while (*link != index) {
+		link = &patternCache.entries[*link].hashNext;
+	}
+	*link = patternCache.entries[index].hashNext;
+	patternCacheUnlink(index);
+	return index;
+}
+
+/*****************************************************************************
+ *
+ * Empty the pattern cache, the hit and miss counters are kept.
+ *
+ ****************************************************************************/
+void clearPatternCache(void)
+{
+	uint32_t bucket;
+	if (patternCache.hashHeads != NULL) {
+		for (bucket = 0; bucket <= patternCache.hashMask; ++bucket) {
+			patternCache.hashHeads[bucket] = PATTERN_CACHE_NONE;
+		}
+	}
+	patternCache.numEntries = 0;
+	patternCache.head = PATTERN_CACHE_NONE;
+	patternCache.tail = PATTERN_CACHE_NONE;
+}
+
+/*****************************************************************************
+ *
+ * Size the pattern cache to memoryBudget bytes and set the angle resolution
+ * of its keys.  A budget too small for one entry disables the cache.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int configurePatternCache(double angleResolution, uint32_t memoryBudget)
+{
+	free(patternCache.entries);
+	free(patternCache.hashHeads);
+	patternCache.entries = NULL;
+	patternCache.hashHeads = NULL;
+	patternCache.maxEntries = 0;
+	patternCache.hashMask = 0;
+	patternCache.hits = 0;
+	patternCache.misses = 0;
+	clearPatternCache();
+
+	if (angleResolution <= 0.0) {
+		printf("ERROR: pattern cache resolution must be positive...\n");
+		return -1;
+	}
+	patternCache.resolution = angleResolution;
+
+	uint32_t maxEntries = memoryBudget / sizeof(patternCacheEntry);
+	if (maxEntries == 0) {
+		return 0;
+	}
+
+	// at least 2 buckets per entry keeps the chains short
+	uint32_t numBuckets = 1;
+	while (numBuckets < 2 * maxEntries) {
+		numBuckets <<= 1;
+	}
+	patternCache.entries = (patternCacheEntry*)malloc(maxEntries
+			* sizeof(patternCacheEntry));
+	patternCache.hashHeads = (uint32_t*)malloc(numBuckets * sizeof(uint32_t));
+	if (patternCache.entries == NULL || patternCache.hashHeads == NULL) {
+		printf("ERROR: pattern cache allocation failed...\n");
+		free(patternCache.entries);
+		free(patternCache.hashHeads);
+		patternCache.entries = NULL;
+		patternCache.hashHeads = NULL;
+		return -1;
+	}
+	patternCache.maxEntries = maxEntries;
+	patternCache.hashMask = numBuckets - 1;
+	clearPatternCache();
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * steerAndPack() through the pattern cache.  The angles are quantized to
+ * the cache resolution, a miss computes the pattern at the quantized angles
+ * so every entry stands for one grid point.
+ *
+ * Returns 1 on a cache hit, 0 on a miss.
+ *
+ ****************************************************************************/
+int steerAndPackCached(double theta, double phi, double phase,
+		uint32_t* packedPattern)
+{
+	if (patternCache.maxEntries == 0) {
+		++patternCache.misses;
+		steerAndPack(theta, phi, phase, packedPattern);
+		return 0;
+	}
+
+	int32_t key[3];
+	key[0] = (int32_t)lround(theta / patternCache.resolution);
+	key[1] = (int32_t)lround(phi / patternCache.resolution);
+	key[2] = (int32_t)lround(phase / patternCache.resolution);
+	uint32_t bucket = patternCacheHash(key);
+
+	uint32_t index = patternCache.hashHeads[bucket];
+	while (index != PATTERN_CACHE_NONE) {
+		patternCacheEntry* entry = &patternCache.entries[index];
+		if (entry->key[0] == key[0] && entry->key[1] == key[1]
+				&& entry->key[2] == key[2]) {
+			++patternCache.hits;
+			if (index != patternCache.head) {
+				patternCacheUnlink(index);
+				patternCachePushFront(index);
+			}
+			memcpy(packedPattern, entry->pattern, sizeof(entry->pattern));
+			// the pattern did not come from a wave calculation, so there is
+			// no pointing left for setPolarization() to recombine
+			lastPointing.valid = false;
+			return 1;
+		}
+		index = entry->hashNext;
+	}
+
+	++patternCache.misses;
+	if (patternCache.numEntries < patternCache.maxEntries) {
+		index = patternCache.numEntries++;
+	}
+	else {
+		index = patternCacheEvict();
+	}
+
+	patternCacheEntry* entry = &patternCache.entries[index];
+	memcpy(entry->key, key, sizeof(key));
+	steerAndPack(key[0] * patternCache.resolution,
+			key[1] * patternCache.resolution,
+			key[2] * patternCache.resolution, entry->pattern);
+	entry->hashNext = patternCache.hashHeads[bucket];
+	patternCache.hashHeads[bucket] = index;
+	patternCachePushFront(index);
+	memcpy(packedPattern, entry->pattern, sizeof(entry->pattern));
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Read the pattern cache hit and miss counters.
+ *
+ ****************************************************************************/
+void getPatternCacheStats(uint32_t* hits, uint32_t* misses)
+{
+	*hits = patternCache.hits;
+	*misses = patternCache.misses;
+}
+
+/*****************************************************************************
+ *
+ * Write a beam codebook file holding the packed pattern of every point of a
+ * theta, phi, phase grid, computed with steerAndPackBatch() and the active
+ * wave kernel.  Meant to run off-target, the file is then copied to the
+ * board and read with openBeamCodebook().
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int writeBeamCodebook(const char* filePath,
+		double thetaStart, double thetaStep, uint32_t numTheta,
+		double phiStart, double phiStep, uint32_t numPhi,
+		double phaseStart, double phaseStep, uint32_t numPhase)
+{
+	const uint32_t patternsPerWrite = 64;
+	beamCodebookHeader header;
+	uint8_t headerBlock[BEAM_CODEBOOK_HEADER_SIZE];
+
+	if (numTheta == 0 || numPhi == 0 || numPhase == 0) {
+		printf("ERROR: empty beam codebook grid...\n");
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = BEAM_CODEBOOK_MAGIC;
+	header.version = BEAM_CODEBOOK_VERSION;
+	header.headerSize = BEAM_CODEBOOK_HEADER_SIZE;
+	header.patternWords = BUF_SIZE;
+	header.numTheta = numTheta;
+	header.numPhi = numPhi;
+	header.numPhase = numPhase;
+	header.thetaStart = thetaStart;
+	header.thetaStep = thetaStep;
+	header.phiStart = phiStart;
+	header.phiStep = phiStep;
+	header.phaseStart = phaseStart;
+	header.phaseStep = phaseStep;
+	initCellGeometry();
+	header.polAngle = polAngleDegrees;
+
+	double* angles = (double*)malloc(3 * patternsPerWrite * sizeof(double));
+	uint32_t* patterns = (uint32_t*)malloc(patternsPerWrite * BUF_SIZE
+			* sizeof(uint32_t));
+	int fd = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (angles == NULL || patterns == NULL || fd == -1) {
+		printf("ERROR: cannot create beam codebook %s...\n", filePath);
+		free(angles);
+		free(patterns);
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	memset(headerBlock, 0, sizeof(headerBlock));
+	memcpy(headerBlock, &header, sizeof(header));
+	bool writeFailed = (write(fd, headerBlock, sizeof(headerBlock))
+			!= sizeof(headerBlock));
+
+	// patterns are stored theta major, then phi, then phase
+	uint32_t numPatterns = numTheta * numPhi * numPhase;
+	uint32_t patternCount = 0;
+	while (!writeFailed && patternCount < numPatterns) {
+		uint32_t batchCount = 0;
+		for (; batchCount < patternsPerWrite && patternCount < numPatterns;
+				++batchCount, ++patternCount) {
+			angles[3 * batchCount] = thetaStart
+					+ (patternCount / (numPhi * numPhase)) * thetaStep;
+			angles[3 * batchCount + 1] = phiStart
+					+ (patternCount / numPhase % numPhi) * phiStep;
+			angles[3 * batchCount + 2] = phaseStart
+					+ (patternCount % numPhase) * phaseStep;
+		}
+		steerAndPackBatch(angles, batchCount, patterns);
+		size_t batchBytes = batchCount * BUF_SIZE * sizeof(uint32_t);
+		writeFailed = (write(fd, patterns, batchBytes) != (ssize_t)batchBytes);
+	}
+
+	free(angles);
+	free(patterns);
+	if (close(fd) != 0 || writeFailed) {
+		printf("ERROR: writing beam codebook %s failed...\n", filePath);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Map a beam codebook file written by writeBeamCodebook() read only and
+ * shared, so every process driving the aperture uses the same page cache
+ * copy.  Replaces a codebook opened earlier.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int openBeamCodebook(const char* filePath)
+{
+	struct stat fileStat;
+
+	closeBeamCodebook();
+
+	int fd = open(filePath, O_RDONLY);
+	if (fd == -1) {
+		printf("Cannot open beam codebook %s.\n", filePath);
+		return -1;
+	}
+	if (fstat(fd, &fileStat) != 0
+			|| fileStat.st_size < BEAM_CODEBOOK_HEADER_SIZE) {
+		printf("ERROR: beam codebook %s is truncated...\n", filePath);
+		close(fd);
+		return -1;
+	}
+
+	void* map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("ERROR: mmap() beam codebook failed...\n");
+		return -1;
+	}
+
+	const beamCodebookHeader* header = (const beamCodebookHeader*)map;
+	uint64_t expectedSize = header->headerSize + (uint64_t)header->numTheta
+			* header->numPhi * header->numPhase * BUF_SIZE * sizeof(uint32_t);
+	if (header->magic != BEAM_CODEBOOK_MAGIC
+			|| header->version != BEAM_CODEBOOK_VERSION
+			|| header->headerSize != BEAM_CODEBOOK_HEADER_SIZE
+			|| header->patternWords != BUF_SIZE
+			|| header->numTheta == 0 || header->numPhi == 0
+			|| header->numPhase == 0
+			|| (uint64_t)fileStat.st_size < expectedSize) {
+		printf("ERROR: %s is not a valid beam codebook...\n", filePath);
+		munmap(map, fileStat.st_size);
+		return -1;
+	}
+
+	beamCodebook.header = header;
+	beamCodebook.patterns = (const uint32_t*)((const uint8_t*)map
+			+ header->headerSize);
+	beamCodebook.mapSize = fileStat.st_size;
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Unmap the beam codebook.
+ *
+ ****************************************************************************/
+void closeBeamCodebook(void)
+{
+	if (beamCodebook.header != NULL) {
+		munmap((void*)beamCodebook.header, beamCodebook.mapSize);
+	}
+	beamCodebook.header = NULL;
+	beamCodebook.patterns = NULL;
+	beamCodebook.mapSize = 0;
+}
+
+/*****************************************************************************
+ *
+ * Nearest grid index of an angle on one codebook axis.  Axes whose grid
+ * spans a full turn wrap around, others clamp to the end points.
+ *
+ ****************************************************************************/
+static uint32_t beamCodebookIndex(double angle, double start, double step,
+		uint32_t count)
+{
+	if (count == 1 || step == 0.0) {
+		return 0;
+	}
+
+	long index = lround((angle - start) / step);
+	if (fabs(count * step) >= 360.0 - fabs(step) / 2.0) {
+		index %= (long)count;
+		return (uint32_t)(index < 0 ? index + count : index);
+	}
+	if (index < 0) {
+		return 0;
+	}
+	return (uint32_t)(index >= (long)count ? count - 1 : index);
+}
+
+/*****************************************************************************
+ *
+ * Look up the codebook pattern nearest to the steering angles, constant
+ * time and no floating point beyond the index calculation.
+ *
+ * Returns a pointer to BUF_SIZE packed words in the mapped file, or NULL
+ * when no codebook is open.
+ *
+ ****************************************************************************/
+const uint32_t* lookupBeamCodebook(double theta, double phi, double phase)
+{
+	const beamCodebookHeader* header = beamCodebook.header;
+	if (header == NULL) {
+		return NULL;
+	}
+
+	uint32_t thetaIndex = beamCodebookIndex(theta, header->thetaStart,
+			header->thetaStep, header->numTheta);
+	uint32_t phiIndex = beamCodebookIndex(phi, header->phiStart,
+			header->phiStep, header->numPhi);
+	uint32_t phaseIndex = beamCodebookIndex(phase, header->phaseStart,
+			header->phaseStep, header->numPhase);
+	lastPointing.valid = false;
+
+	return beamCodebook.patterns + ((size_t)(thetaIndex * header->numPhi
+			+ phiIndex) * header->numPhase + phaseIndex) * BUF_SIZE;
+}
+
+/*****************************************************************************
+ *
+ * Toggle a bank select register by writing back its complement.
+ *
+ ****************************************************************************/
+static void toggleBankSelect(uint8_t addressOffset)
+{
+	uint64_t stageStart = startStageTimer();
+	patternWriteBarrier();
+	writeRegisterValue(addressOffset, ~readRegisterValue(addressOffset));
+	patternWriteBarrier();
+	stopStageTimer(STAGE_BANK_SWAP, stageStart);
+}
+
+/*****************************************************************************
+ *
+ * Unmask the FPGA interrupt on its UIO node by writing a 32 bit 1 to it.
+ *
+ ****************************************************************************/
+static int unmaskConiferIrq(void)
+{
+	uint32_t irqOn = 1;
+	return (write(fdConiferIrq, &irqOn, sizeof(irqOn)) == sizeof(irqOn) ?
+			0 : -1);
+}
+
+/*****************************************************************************
+ *
+ * Enable interrupt driven conifer_isr waits through the UIO node of the
+ * FPGA interrupt, e.g. /dev/uio0.  The aperture device opened by
+ * openAndMapFpgaMemory() is never written, its file offset 0 is the
+ * control register.
+ *
+ * Returns 0 on success, -1 if the node cannot be opened or does not take
+ * the unmask write, the waits then poll the register.
+ *
+ ****************************************************************************/
+int enableConiferIrq(const char* uioPath)
+{
+	disableConiferIrq();
+
+	fdConiferIrq = open(uioPath, O_RDWR);
+	if (fdConiferIrq == -1) {
+		printf("Cannot open FPGA interrupt device %s.\n", uioPath);
+		return -1;
+	}
+	if (unmaskConiferIrq() != 0) {
+		printf("FPGA interrupt not available, polling conifer_isr.\n");
+		disableConiferIrq();
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Close the UIO node of the FPGA interrupt, conifer_isr waits poll the
+ * register again.
+ *
+ ****************************************************************************/
+void disableConiferIrq(void)
+{
+	if (fdConiferIrq != -1) {
+		close(fdConiferIrq);
+	}
+	fdConiferIrq = -1;
+}
+
+/*****************************************************************************
+ *
+ * File descriptor that becomes readable on the FPGA interrupt, for
+ * applications that wait in their own event loop.
+ *
+ * Returns the descriptor, or -1 when interrupts are not enabled.
+ *
+ ****************************************************************************/
+int getConiferIrqFd(void)
+{
+	return fdConiferIrq;
+}
+
+/*****************************************************************************
+ *
+ * Wait until the FPGA clears conifer_isr or timeoutUs passes.  The register
+ * is polled for a short spin first.  After that the wait blocks on the
+ * interrupt when enableConiferIrq() succeeded, and otherwise sleeps briefly
+ * between polls.  If the UIO node fails the interrupt is disabled and the
+ * wait goes on polling.
+ *
+ * Returns 0 once the register reads 0, -1 on timeout.
+ *
+ ****************************************************************************/
+int waitForConiferIrq(uint32_t timeoutUs)
+{
+	uint64_t now = readTimestampNs();
+	uint64_t deadline = now + (uint64_t)timeoutUs * 1000;
+	uint64_t spinEnd = now + CONIFER_SPIN_NS;
+
+	while (readRegisterValue(coniferIsrOffset) > 0) {
+		now = readTimestampNs();
+		if (now >= deadline) {
+			return -1;
+		}
+		if (now < spinEnd) {
+			continue;
+		}
+
+		if (fdConiferIrq == -1) {
+			usleep(CONIFER_POLL_SLEEP_US);
+			continue;
+		}
+
+		// unmask before checking the register again, so an interrupt that
+		// arrives in between still wakes the poll
+		if (unmaskConiferIrq() != 0) {
+			disableConiferIrq();
+			continue;
+		}
+		if (readRegisterValue(coniferIsrOffset) == 0) {
+			break;
+		}
+		struct pollfd irqPoll = { .fd = fdConiferIrq, .events = POLLIN };
+		int timeoutMs = (int)((deadline - now + 999999) / 1000000);
+		if (poll(&irqPoll, 1, timeoutMs) > 0) {
+			uint32_t irqCount;
+			if (read(fdConiferIrq, &irqCount, sizeof(irqCount))
+					!= sizeof(irqCount)) {
+				disableConiferIrq();
+			}
+		}
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Set how long commitPatternDoubleBuffered() waits for conifer_isr.
+ *
+ ****************************************************************************/
+void setPatternCommitTimeout(uint32_t timeoutUs)
+{
+	commitTimeoutUs = timeoutUs;
+}
+
+/*****************************************************************************
+ *
+ * Run the pattern bank protocol for a packed pattern:
+ * 	1.	toggle bank_sel_hps to take the idle bank
+ * 	2.	wait for conifer_isr to clear
+ * 	3.	write the words that changed into the bank
+ * 	4.	check the bank against the pattern, as set by setPatternVerify()
+ * 	5.	toggle bank_sel_conifer to hand the bank to the FPGA
+ *
+ * On timeout bank_sel_hps is toggled back and nothing is written.  A bank
+ * that fails the check is not handed over either.
+ *
+ * Returns 0 on success, -1 on timeout or a failed check.
+ *
+ ****************************************************************************/
+int commitPatternDoubleBuffered(const uint32_t* packedPattern)
+{
+	toggleBankSelect(bankSelHpsOffset);
+
+	uint64_t stageStart = startStageTimer();
+	int waitResult = waitForConiferIrq(commitTimeoutUs);
+	stopStageTimer(STAGE_IRQ_WAIT, stageStart);
+	if (waitResult != 0) {
+		printf("ERROR: timed out waiting for conifer_isr...\n");
+		toggleBankSelect(bankSelHpsOffset);
+		lastDeltaWords = 0;
+		return -1;
+	}
+
+	lastDeltaWords = writePatternDelta(packedPattern);
+	if (verifyCommittedPattern(packedPattern) != 0) {
+		toggleBankSelect(bankSelHpsOffset);
+		return -1;
+	}
+	toggleBankSelect(bankSelConiferOffset);
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Number of words the last commitPatternDoubleBuffered() wrote into pattern
+ * Ram, 0 when its wait timed out.
+ *
+ ****************************************************************************/
+uint32_t getLastDeltaWords(void)
+{
+	return lastDeltaWords;
+}
+
+/*****************************************************************************
+ *
+ * Pack the modulation matrix built by populateModulationMatrix() and commit
+ * it with commitPatternDoubleBuffered().
+ *
+ * Returns 0 on success, -1 on timeout.
+ *
+ ****************************************************************************/
+int commitModulationDoubleBuffered(void)
+{
+	packModulationBuffer(zeroBuffer);
+	return commitPatternDoubleBuffered(zeroBuffer);
+}
+
+/*****************************************************************************
+ *
+ * Return the packed pattern of a diagnostic preset, packing it on the first
+ * call.  A checkerboard cell is on when its row and column are both even or
+ * both odd, as in populateModulationMatrix().
+ *
+ ****************************************************************************/
+const uint32_t* getPresetPattern(patternPreset preset)
+{
+	if ((unsigned)preset >= NUM_PATTERN_PRESETS) {
+		printf("Unknown pattern preset: %d\n", (int)preset);
+		return NULL;
+	}
+	if (presetPatternValid[preset]) {
+		return presetPatterns[preset];
+	}
+
+	uint16_t loopCount;
+	for (loopCount = 0; loopCount < ACTV_CELLS; ++loopCount) {
+		switch (preset) {
+		case PRESET_ALL_ON:
+			cellLevel[loopCount] = 1;
+			break;
+		case PRESET_CHECKERBOARD:
+			cellLevel[loopCount] = !((kdkRowBitMask[loopCount]
+					^ kdkColumnBitMask[loopCount]) & 1);
+			break;
+		default:
+			cellLevel[loopCount] = 0;
+			break;
+		}
+	}
+	packCellLevels(cellLevel, presetPatterns[preset]);
+	presetPatternValid[preset] = true;
+
+	return presetPatterns[preset];
+}
+
+/*****************************************************************************
+ *
+ * Commit a diagnostic preset, the packed pattern is cached so this is a
+ * straight commitPatternDoubleBuffered().
+ *
+ * Returns 0 on success, -1 on timeout or if the preset is not known.
+ *
+ ****************************************************************************/
+int commitPresetPattern(patternPreset preset)
+{
+	const uint32_t* presetPattern = getPresetPattern(preset);
+	if (presetPattern == NULL) {
+		return -1;
+	}
+	return commitPatternDoubleBuffered(presetPattern);
+}
+
+/*****************************************************************************
+ *
+ * Pack a cell bitmap with packCellBitmap() and commit it with
+ * commitPatternDoubleBuffered().
+ *
+ * Returns 0 on success, -1 on timeout.
+ *
+ ****************************************************************************/
+int commitCellBitmap(const uint8_t* cellBitmap)
+{
+	packCellBitmap(cellBitmap, zeroBuffer);
+	return commitPatternDoubleBuffered(zeroBuffer);
+}
+
+/*****************************************************************************
+ *
+ * Inverse of packCellBitmap(), read each active cell's bit back out of a
+ * packed pattern into a cell bitmap of CELL_BITMAP_BYTES.
+ *
+ ****************************************************************************/
+void unpackCellBitmap(const uint32_t* packedPattern, uint8_t* cellBitmap)
+{
+	initCellPacking();
+
+	memset(cellBitmap, 0, CELL_BITMAP_BYTES);
+	const cellPackEntry* entry = cellPackTable;
+	const cellPackEntry* tableEnd = cellPackTable + ACTV_CELLS;
+	while (entry < tableEnd) {
+		uint16_t word = entry->word;
+		uint32_t wordValue = packedPattern[word];
+		for (; entry < tableEnd && entry->word == word; ++entry) {
+			cellBitmap[entry->cell >> 3] |=
+					(uint8_t)((wordValue & entry->mask) != 0)
+					<< (entry->cell & 7);
+		}
+	}
+}
+
+/*****************************************************************************
+ *
+ * Inverse of packModulationBuffer(), expand a packed pattern into a
+ * MAX_ROWS x MAX_COLS modulation matrix of 0 / 1 values.
+ *
+ ****************************************************************************/
+void unpackModulationMatrix(const uint32_t* packedPattern, uint8_t* matrix)
+{
+	initCellPacking();
+
+	memset(matrix, 0, MAX_ROWS * MAX_COLS);
+	const cellPackEntry* entry = cellPackTable;
+	const cellPackEntry* tableEnd = cellPackTable + ACTV_CELLS;
+	for (; entry < tableEnd; ++entry) {
+		matrix[entry->matrixIndex] =
+				((packedPattern[entry->word] & entry->mask) != 0);
+	}
+}
+
+/*****************************************************************************
+ *
+ * Count the bits that differ between the pattern RAM and an expected
+ * packed pattern.  Every bit is compared, so stray bits outside the active
+ * cells count too.
+ *
+ ****************************************************************************/
+uint32_t countPatternBitErrors(const uint32_t* expectedPattern)
+{
+	const uint32_t* pattRam = (const uint32_t*)patternBuffer;
+	uint32_t bitErrors = 0;
+	uint32_t i = 0;
+
+	patternWriteBarrier();
+#ifdef USE_NEON_KERNELS
+	uint32x4_t errorSum = vdupq_n_u32(0);
+	for (; i + 4 <= BUF_SIZE; i += 4) {
+		uint32x4_t diff = veorq_u32(vld1q_u32(&pattRam[i]),
+				vld1q_u32(&expectedPattern[i]));
+		uint8x16_t bitCounts = vcntq_u8(vreinterpretq_u8_u32(diff));
+		errorSum = vaddq_u32(errorSum,
+				vpaddlq_u16(vpaddlq_u8(bitCounts)));
+	}
+	bitErrors = vgetq_lane_u32(errorSum, 0) + vgetq_lane_u32(errorSum, 1)
+			+ vgetq_lane_u32(errorSum, 2) + vgetq_lane_u32(errorSum, 3);
+#endif
+	for (; i < BUF_SIZE; ++i) {
+		bitErrors += __builtin_popcount(pattRam[i] ^ expectedPattern[i]);
+	}
+
+	return bitErrors;
+}
+
+/*****************************************************************************
+ *
+ * Open a pattern snapshot log for appending, creating it if needed.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int openSnapshotLog(const char* filePath)
+{
+	closeSnapshotLog();
+
+	fdSnapshot = open(filePath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fdSnapshot == -1) {
+		printf("Cannot open snapshot log %s.\n", filePath);
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Close the pattern snapshot log.
+ *
+ ****************************************************************************/
+void closeSnapshotLog(void)
+{
+	if (fdSnapshot != -1) {
+		close(fdSnapshot);
+	}
+	fdSnapshot = -1;
+}
+
+/*****************************************************************************
+ *
+ * Fill in a snapshot header for a packed pattern, except for the CRC32 which
+ * the writer adds.  The record size covers the pattern words, the
+ * modulation vector when included and the padding that keeps the next
+ * record 8 byte aligned.  The bank comes from the last pattern Ram write and
+ * the polarization from the last setPolarization(), both cached, so this
+ * does no register reads or trigonometry.
+ *
+ ****************************************************************************/
+static void initSnapshotHeader(patternSnapshotHeader* header, double theta,
+		double phi, double phase, uint64_t timestampNs, bool includeModulation)
+{
+	uint32_t payloadSize = BUF_SIZE * sizeof(uint32_t)
+			+ (includeModulation ? ACTV_CELLS * sizeof(float) : 0);
+
+	memset(header, 0, sizeof(*header));
+	header->magic = PATTERN_SNAPSHOT_MAGIC;
+	header->version = PATTERN_SNAPSHOT_VERSION;
+	header->headerSize = sizeof(*header);
+	header->recordSize = (sizeof(*header) + payloadSize + 7) & ~7u;
+	header->patternWords = BUF_SIZE;
+	header->numRows = numRows;
+	header->numCols = numCols;
+	header->activeCells = ACTV_CELLS;
+	header->modulationCells = (includeModulation ? ACTV_CELLS : 0);
+	header->bank = patternWriteLatch.bank;
+	header->timestampNs = timestampNs;
+	header->theta = theta;
+	header->phi = phi;
+	header->phase = phase;
+	header->polAngle = polAngleDegrees;
+}
+
+/*****************************************************************************
+ *
+ * Append a snapshot of a packed pattern to the open snapshot log, with one
+ * writev().  The modulation vector is the real modulation per active cell
+ * left by the last wave calculation.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int appendPatternSnapshot(const uint32_t* packedPattern, double theta,
+		double phi, double phase, bool includeModulation)
+{
+	static const uint8_t recordPad[8];
+	patternSnapshotHeader header;
+	uint16_t loopCount;
+
+	if (fdSnapshot == -1) {
+		printf("ERROR: no snapshot log open...\n");
+		return -1;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	initSnapshotHeader(&header, theta, phi, phase,
+			(uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec,
+			includeModulation);
+	header.patternCrc = calcPatternCrc32(packedPattern);
+	if (includeModulation) {
+		for (loopCount = 0; loopCount < ACTV_CELLS; ++loopCount) {
+			modulationSnapshot[loopCount] = (float)modulationReal[loopCount];
+		}
+	}
+
+	struct iovec record[4] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = (void*)packedPattern,
+		  .iov_len = BUF_SIZE * sizeof(uint32_t) },
+		{ .iov_base = modulationSnapshot,
+		  .iov_len = header.modulationCells * sizeof(float) },
+		{ .iov_base = (void*)recordPad, .iov_len = 0 },
+	};
+	record[3].iov_len = header.recordSize - sizeof(header)
+			- record[1].iov_len - record[2].iov_len;
+
+	if (writev(fdSnapshot, record, 4) != (ssize_t)header.recordSize) {
+		printf("ERROR: snapshot write failed...\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Map a pattern snapshot log read only and rewind to its first record.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int openSnapshotReader(const char* filePath)
+{
+	struct stat fileStat;
+
+	closeSnapshotReader();
+
+	int fd = open(filePath, O_RDONLY);
+	if (fd == -1) {
+		printf("Cannot open snapshot log %s.\n", filePath);
+		return -1;
+	}
+	if (fstat(fd, &fileStat) != 0) {
+		printf("ERROR: cannot stat snapshot log %s...\n", filePath);
+		close(fd);
+		return -1;
+	}
+	if (fileStat.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	void* map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("ERROR: mmap() snapshot log failed...\n");
+		return -1;
+	}
+
+	snapshotReader.map = (const uint8_t*)map;
+	snapshotReader.mapSize = fileStat.st_size;
+	snapshotReader.offset = 0;
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Return the next snapshot in the mapped log, in place.
+ *
+ * Returns a pointer to the header, NULL at the end of the log or at a
+ * record that is truncated or not a snapshot.
+ *
+ ****************************************************************************/
+const patternSnapshotHeader* nextPatternSnapshot(void)
+{
+	size_t remaining = snapshotReader.mapSize - snapshotReader.offset;
+	if (snapshotReader.map == NULL
+			|| remaining < sizeof(patternSnapshotHeader)) {
+		return NULL;
+	}
+
+	const patternSnapshotHeader* header = (const patternSnapshotHeader*)
+			(snapshotReader.map + snapshotReader.offset);
+	uint64_t payloadSize = header->headerSize
+			+ (uint64_t)header->patternWords * sizeof(uint32_t)
+			+ (uint64_t)header->modulationCells * sizeof(float);
+	if (header->magic != PATTERN_SNAPSHOT_MAGIC
+			|| header->version != PATTERN_SNAPSHOT_VERSION
+			|| header->headerSize < sizeof(patternSnapshotHeader)
+			|| (header->headerSize & 3) != 0
+			|| header->recordSize < payloadSize
+			|| (header->recordSize & 7) != 0
+			|| header->recordSize > remaining) {
+		printf("ERROR: bad snapshot record at offset %zu...\n",
+				snapshotReader.offset);
+		return NULL;
+	}
+
+	snapshotReader.offset += header->recordSize;
+	return header;
+}
+
+/*****************************************************************************
+ *
+ * Pattern words of a snapshot returned by nextPatternSnapshot().
+ *
+ ****************************************************************************/
+const uint32_t* getSnapshotPattern(const patternSnapshotHeader* header)
+{
+	return (const uint32_t*)((const uint8_t*)header + header->headerSize);
+}
+
+/*****************************************************************************
+ *
+ * Modulation vector of a snapshot returned by nextPatternSnapshot(), NULL
+ * when it was not recorded.
+ *
+ ****************************************************************************/
+const float* getSnapshotModulation(const patternSnapshotHeader* header)
+{
+	if (header->modulationCells == 0) {
+		return NULL;
+	}
+	return (const float*)(getSnapshotPattern(header) + header->patternWords);
+}
+
+/*****************************************************************************
+ *
+ * Unmap the snapshot log being read.
+ *
+ ****************************************************************************/
+void closeSnapshotReader(void)
+{
+	if (snapshotReader.map != NULL) {
+		munmap((void*)snapshotReader.map, snapshotReader.mapSize);
+	}
+	snapshotReader.map = NULL;
+	snapshotReader.mapSize = 0;
+	snapshotReader.offset = 0;
+}
+
+/*****************************************************************************
+ *
+ * Recorder thread, wakes every RECORDER_FLUSH_INTERVAL_US, adds the CRC32 to
+ * the queued records and writes them out with one writev() per wrap of the
+ * ring.  Drains the ring once more after a stop request.
+ *
+ ****************************************************************************/
+static void* patternRecorderThread(void* arg)
+{
+	(void)arg;
+	// raise the nice value, lowering the priority, of this thread only, on
+	// Linux PRIO_PROCESS with 0 applies to the calling thread
+	setpriority(PRIO_PROCESS, 0, RECORDER_NICE_VALUE);
+
+	bool lastPass = false;
+	while (!lastPass) {
+		usleep(RECORDER_FLUSH_INTERVAL_US);
+		lastPass = __atomic_load_n(&patternRecorder.stopping,
+				__ATOMIC_ACQUIRE);
+
+		uint32_t tail = patternRecorder.tail;
+		uint32_t head = __atomic_load_n(&patternRecorder.head,
+				__ATOMIC_ACQUIRE);
+		if (head == tail) {
+			continue;
+		}
+
+		uint32_t slotCount = patternRecorder.slotMask + 1;
+		uint32_t first = tail & patternRecorder.slotMask;
+		uint32_t queued = head - tail;
+		uint32_t firstRun = (queued < slotCount - first ?
+				queued : slotCount - first);
+		uint32_t loopCount;
+		for (loopCount = tail; loopCount != head; ++loopCount) {
+			recorderSlot* slot = &patternRecorder.slots[loopCount
+					& patternRecorder.slotMask];
+			slot->header.patternCrc = calcPatternCrc32(slot->pattern);
+		}
+
+		struct iovec batch[2] = {
+			{ .iov_base = &patternRecorder.slots[first],
+			  .iov_len = firstRun * sizeof(recorderSlot) },
+			{ .iov_base = &patternRecorder.slots[0],
+			  .iov_len = (queued - firstRun) * sizeof(recorderSlot) },
+		};
+		if (writev(patternRecorder.fd, batch, 2)
+				!= (ssize_t)(queued * sizeof(recorderSlot))) {
+			printf("ERROR: pattern recorder write failed...\n");
+		}
+		else {
+			__atomic_store_n(&patternRecorder.recorded,
+					patternRecorder.recorded + queued, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&patternRecorder.tail, head, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************
+ *
+ * Start the background pattern recorder, appending to a snapshot log.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int startPatternRecorder(const char* filePath, uint32_t ringSlots)
+{
+	if (patternRecorder.running) {
+		printf("ERROR: pattern recorder already running...\n");
+		return -1;
+	}
+
+	uint32_t slotCount = 1;
+	ringSlots = (ringSlots == 0 ? DEFAULT_RECORDER_SLOTS : ringSlots);
+	while (slotCount < ringSlots) {
+		slotCount <<= 1;
+	}
+
+	patternRecorder.fd = open(filePath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (patternRecorder.fd == -1) {
+		printf("Cannot open snapshot log %s.\n", filePath);
+		return -1;
+	}
+	patternRecorder.slots = (recorderSlot*)malloc(slotCount
+			* sizeof(recorderSlot));
+	if (patternRecorder.slots == NULL) {
+		printf("ERROR: cannot allocate pattern recorder ring...\n");
+		close(patternRecorder.fd);
+		patternRecorder.fd = -1;
+		return -1;
+	}
+
+	patternRecorder.slotMask = slotCount - 1;
+	patternRecorder.head = 0;
+	patternRecorder.tail = 0;
+	patternRecorder.recorded = 0;
+	patternRecorder.overruns = 0;
+	patternRecorder.stopping = false;
+	if (pthread_create(&patternRecorder.thread, NULL, patternRecorderThread,
+			NULL) != 0) {
+		printf("ERROR: pthread_create() failed...\n");
+		free(patternRecorder.slots);
+		patternRecorder.slots = NULL;
+		close(patternRecorder.fd);
+		patternRecorder.fd = -1;
+		return -1;
+	}
+	patternRecorder.running = true;
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Queue a snapshot of a packed pattern for the recorder thread.  Never
+ * blocks, when the ring is full the snapshot is dropped and counted as an
+ * overrun.  Only one thread may record.
+ *
+ * Returns 0 when queued, -1 when dropped or the recorder is not running.
+ *
+ ****************************************************************************/
+int recordPatternSnapshot(const uint32_t* packedPattern, double theta,
+		double phi, double phase)
+{
+	if (!patternRecorder.running) {
+		return -1;
+	}
+
+	uint32_t head = patternRecorder.head;
+	uint32_t tail = __atomic_load_n(&patternRecorder.tail, __ATOMIC_ACQUIRE);
+	if (head - tail > patternRecorder.slotMask) {
+		++patternRecorder.overruns;
+		return -1;
+	}
+
+	recorderSlot* slot = &patternRecorder.slots[head
+			& patternRecorder.slotMask];
+	initSnapshotHeader(&slot->header, theta, phi, phase,
+			patternWriteLatch.timestampNs, false);
+	memcpy(slot->pattern, packedPattern, sizeof(slot->pattern));
+	__atomic_store_n(&patternRecorder.head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*****************************************************************************
+ *
+ * Stop the recorder thread after it has written out the queued snapshots.
+ *
+ ****************************************************************************/
+void stopPatternRecorder(void)
+{
+	if (!patternRecorder.running) {
+		return;
+	}
+
+	__atomic_store_n(&patternRecorder.stopping, true, __ATOMIC_RELEASE);
+	pthread_join(patternRecorder.thread, NULL);
+	free(patternRecorder.slots);
+	patternRecorder.slots = NULL;
+	close(patternRecorder.fd);
+	patternRecorder.fd = -1;
+	patternRecorder.running = false;
+}
+
+/*****************************************************************************
+ *
+ * Report how many snapshots the recorder wrote and how many were dropped
+ * because the ring was full.
+ *
+ ****************************************************************************/
+void getPatternRecorderStats(uint32_t* recorded, uint32_t* overruns)
+{
+	*recorded = __atomic_load_n(&patternRecorder.recorded, __ATOMIC_RELAXED);
+	*overruns = patternRecorder.overruns;
 }
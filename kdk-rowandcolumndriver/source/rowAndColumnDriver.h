@@ -35,18 +35,158 @@
 #include <math.h>
 #include <stdlib.h>
 #include <complex.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <limits.h>
 
 // define the static shared array dimensions
 #define	MAX_ROWS	160
 #define MAX_COLS	160
 #define BUF_SIZE	1050
 #define ACTV_CELLS	8208
+#define CELL_BITMAP_BYTES	((ACTV_CELLS + 7) / 8)
 
 // declare numerical constants
 const int pageSize = 4096;
 const int numPages = 16;
 const int pattRamOffset = 32768;
 
+// FPGA control register byte offsets used by the pattern bank protocol
+const uint8_t coniferIsrOffset = 32;
+const uint8_t bankSelHpsOffset = 36;
+const uint8_t bankSelConiferOffset = 40;
+
+// beam codebook file layout, a header padded to one page followed by
+// numTheta * numPhi * numPhase patterns of patternWords words, stored theta
+// major, then phi, then phase
+#define BEAM_CODEBOOK_MAGIC			0x4b42444b	// "KDBK"
+#define BEAM_CODEBOOK_VERSION		1
+#define BEAM_CODEBOOK_HEADER_SIZE	4096
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t headerSize;	// byte offset of the first pattern
+	uint32_t patternWords;	// BUF_SIZE
+	uint32_t numTheta;
+	uint32_t numPhi;
+	uint32_t numPhase;
+	uint32_t reserved;
+	double thetaStart;		// grid start and step, degrees
+	double thetaStep;
+	double phiStart;
+	double phiStep;
+	double phaseStart;
+	double phaseStep;
+	double polAngle;		// linear polarization the file was made with
+} beamCodebookHeader;
+
+// pattern snapshot log, a sequence of records each made of this header,
+// patternWords packed pattern words, modulationCells floats of real
+// modulation per active cell and padding up to recordSize, host byte order
+#define PATTERN_SNAPSHOT_MAGIC		0x5053444b	// "KDSP"
+#define PATTERN_SNAPSHOT_VERSION	1
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t headerSize;		// byte offset of the pattern words
+	uint32_t recordSize;		// bytes to the next record, multiple of 8
+	uint32_t patternWords;		// BUF_SIZE
+	uint16_t numRows;
+	uint16_t numCols;
+	uint32_t activeCells;		// ACTV_CELLS
+	uint32_t modulationCells;	// 0 or ACTV_CELLS
+	uint32_t patternCrc;		// calcPatternCrc32() of the pattern words
+	uint8_t bank;				// bank_sel_hps of the last pattern Ram write
+	uint8_t reserved[7];
+	uint64_t timestampNs;		// CLOCK_REALTIME of the append, or of the
+								// last pattern Ram write when recorded
+	double theta;				// steering angles, degrees
+	double phi;
+	double phase;
+	double polAngle;
+} patternSnapshotHeader;
+
+// binary debug trace, a sequence of records each made of this header
+// followed by elementCount elements of elementSize bytes, host byte order
+#define TRACE_RECORD_MAGIC	0x5254444b	// "KDTR"
+
+typedef enum {
+	TRACE_MODULATION_MASK = 1,		// modulationMask, MAX_ROWS x MAX_COLS bytes
+	TRACE_MODULATION_MATRIX = 2,	// modulationBuffer, same layout
+	TRACE_WAVE_MODULATION = 3,		// waveModMask, same layout
+	TRACE_DESIRED_PATTERN = 4		// packed pattern words
+} traceRecordType;
+
+typedef struct {
+	uint32_t magic;
+	uint16_t recordType;
+	uint16_t elementSize;
+	uint32_t elementCount;
+	uint32_t reserved;
+	uint64_t timestampNs;	// CLOCK_REALTIME
+} traceRecordHeader;
+
+// stages of a pattern update timed by setStageTiming(), the numbering is
+// part of the interface used by the Python scripts
+typedef enum {
+	STAGE_WAVE_COMPUTE = 0,	// wave equation per cell
+	STAGE_QUANTIZE = 1,		// real modulation to on / off
+	STAGE_PACK = 2,			// cell levels to pattern words
+	STAGE_UPLOAD = 3,		// pattern words to pattern Ram
+	STAGE_BANK_SWAP = 4,	// one bank select register toggle
+	STAGE_IRQ_WAIT = 5,		// waiting for conifer_isr during a commit
+	NUM_LATENCY_STAGES
+} latencyStage;
+
+typedef struct {
+	uint32_t count;			// samples since the last reset
+	uint32_t minNs;
+	uint32_t meanNs;
+	uint32_t maxNs;
+	uint32_t p99Ns;			// over the latest 1024 samples
+} stageLatencyStats;
+
+// diagnostic patterns built directly in the packed layout, the numbering
+// is part of the interface used by the Python scripts
+typedef enum {
+	PRESET_ALL_OFF = 0,
+	PRESET_ALL_ON = 1,
+	PRESET_CHECKERBOARD = 2,
+	NUM_PATTERN_PRESETS
+} patternPreset;
+
+/*****************************************************************************
+ *
+ * Select the debug trace of the intermediate buffers.  With "off", the
+ * default, pattern updates do no file I/O.  "binary" appends
+ * traceRecordHeader records to tracePath, "csv" writes the CSV files
+ * (modMask.csv, modBuffer.csv, waveModulationMatrix.csv,
+ * desiredPatternBuffer.csv) into the directory set by setExportDirectory(),
+ * the working directory by default.
+ *
+ * Returns 0 on success, -1 if the level is not recognized or the trace
+ * file cannot be opened.
+ *
+ ****************************************************************************/
+int setTraceLevel(const char* levelName, const char* tracePath);
+
+/*****************************************************************************
+ *
+ * Set the directory the CSV exports, readAndSavePatternBuffer() and the
+ * "csv" trace level write to.  NULL or "" selects the working directory,
+ * the default.  Absolute file names are not affected.
+ *
+ * Returns 0 on success, -1 if the path is not a directory.
+ *
+ ****************************************************************************/
+int setExportDirectory(const char* dirPath);
+
 /*****************************************************************************
  *
  * Utility function, evaluates input integer and returns true if even, false
@@ -112,6 +252,23 @@ int openAndMapFpgaMemory(const char* pathName);
  ****************************************************************************/
 int closeAndUnmapFpgaMemory(void);
 
+/*****************************************************************************
+ *
+ * Optionally map the pattern Ram a second time with write combining
+ * attributes, while the control registers stay strongly ordered.  Uploads
+ * then go out as 64 byte NEON bursts followed by a barrier.  Call after
+ * openAndMapFpgaMemory(), closeAndUnmapFpgaMemory() releases it.
+ *
+ * argument1:	dedicated device node, e.g. a UIO node, whose mapping at
+ * 				offset 0 is the pattern Ram with write combined pages, the
+ * 				aperture device is not remapped
+ *
+ * Returns 0 on success, -1 on failure, uploads then keep the uncached
+ * mapping.
+ *
+ ****************************************************************************/
+int mapPatternRamWriteCombined(const char* pathName);
+
 /*****************************************************************************
  *
  * Build up the modulation masks from the bit mask header files, for each
@@ -172,6 +329,297 @@ void readAndSavePatternBuffer(const char* fileName);
 void writeBlockMemoryToPatternBuffer(uint16_t* blockStart, uint16_t length,
 		uint16_t offset);
 
+/*****************************************************************************
+ *
+ * Select how pattern uploads are paced.  By default the pattern is written
+ * as a single burst followed by a memory barrier.
+ *
+ * argument1:	"none"	single burst
+ * 				"sleep"	usleep() for the pause after every burst
+ * 				"spin"	busy wait on the monotonic clock for the pause after
+ * 						every burst
+ * argument2:	words per burst, 0 for the whole pattern
+ * argument3:	pause between bursts in nanoseconds
+ *
+ * Returns 0 on success, -1 if the pacing mode is not recognized.
+ *
+ ****************************************************************************/
+int setPatternWritePacing(const char* pacingMode, uint32_t burstWords,
+		uint32_t pauseNs);
+
+/*****************************************************************************
+ *
+ * Write a packed pattern of BUF_SIZE words, as built by steerAndPack(),
+ * into pattern Ram using the selected pacing.
+ *
+ ****************************************************************************/
+void writePackedPatternToFPGA(const uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * Write a packed pattern into the pattern Ram bank selected by
+ * bank_sel_hps, skipping the words that already hold the right value.  A
+ * cached shadow copy of each bank is compared word by word, the uncached
+ * device memory is only written for the words that differ.
+ *
+ * Returns the number of words written, BUF_SIZE when the bank contents were
+ * not known.
+ *
+ ****************************************************************************/
+uint32_t writePatternDelta(const uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * CRC32, polynomial 0xEDB88320, of the BUF_SIZE words of a packed pattern
+ * as they sit in memory.  Matches zlib's crc32() of the same bytes.
+ *
+ ****************************************************************************/
+uint32_t calcPatternCrc32(const uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * Select when commits read pattern Ram back and compare its CRC32 with the
+ * CRC32 of the staged pattern.
+ *
+ * argument1:	"off", "every commit" (the default) or "every n"
+ * argument2:	commits per check for "every n"
+ *
+ * Returns 0 on success, -1 if the mode is not recognized.
+ *
+ ****************************************************************************/
+int setPatternVerify(const char* verifyName, uint32_t interval);
+
+/*****************************************************************************
+ *
+ * Read pattern Ram back and compare its CRC32 with the CRC32 of a packed
+ * pattern, regardless of the verify mode.
+ *
+ * Returns 0 when they match, -1 otherwise.
+ *
+ ****************************************************************************/
+int verifyPatternWrite(const uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * Enable interrupt driven waits for conifer_isr through the UIO node of the
+ * FPGA interrupt: writing 1 unmasks the interrupt, and read() or poll()
+ * blocks until it fires.  The library keeps its own descriptor for the
+ * node, the aperture device is never written.  closeAndUnmapFpgaMemory()
+ * disables it.
+ *
+ * argument1:	UIO node of the FPGA interrupt, e.g. /dev/uio0
+ *
+ * Returns 0 on success, -1 if the node cannot be opened or does not take
+ * the unmask, waits then fall back to polling the register.
+ *
+ ****************************************************************************/
+int enableConiferIrq(const char* uioPath);
+
+/*****************************************************************************
+ *
+ * Close the UIO node of the FPGA interrupt, waits poll conifer_isr again.
+ *
+ ****************************************************************************/
+void disableConiferIrq(void);
+
+/*****************************************************************************
+ *
+ * File descriptor that becomes readable when the FPGA interrupt fires, for
+ * integration into an application event loop.  Unmask with a 32 bit write
+ * of 1 and consume each interrupt with a 4 byte read().
+ *
+ * Returns the descriptor, -1 when interrupts are not enabled.
+ *
+ ****************************************************************************/
+int getConiferIrqFd(void);
+
+/*****************************************************************************
+ *
+ * Wait for the FPGA to clear conifer_isr.  Spins on the register briefly,
+ * then blocks on the interrupt if enabled, otherwise polls with short
+ * sleeps.
+ *
+ * argument1:	timeout in microseconds
+ *
+ * Returns 0 once the register reads 0, -1 on timeout.
+ *
+ ****************************************************************************/
+int waitForConiferIrq(uint32_t timeoutUs);
+
+/*****************************************************************************
+ *
+ * Set how long commitPatternDoubleBuffered() waits for the FPGA to clear
+ * conifer_isr, in microseconds.  The default is 100 ms.
+ *
+ ****************************************************************************/
+void setPatternCommitTimeout(uint32_t timeoutUs);
+
+/*****************************************************************************
+ *
+ * Commit a packed pattern through the pattern Ram double buffer: toggle
+ * bank_sel_hps, wait for conifer_isr to clear, write the pattern with
+ * writePatternDelta(), check it when setPatternVerify() says so and toggle
+ * bank_sel_conifer.  Replaces the register sequence and fixed sleeps of the
+ * test scripts.
+ *
+ * Returns 0 on success, -1 if conifer_isr did not clear before the timeout,
+ * in which case bank_sel_hps is restored and nothing is written, or if the
+ * readback check failed, in which case bank_sel_hps is restored and the
+ * bank is not handed to the FPGA.
+ *
+ ****************************************************************************/
+int commitPatternDoubleBuffered(const uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * Number of words the last commitPatternDoubleBuffered() wrote, as returned
+ * by writePatternDelta(), BUF_SIZE when the bank contents were not known and
+ * 0 when the commit timed out before writing.
+ *
+ ****************************************************************************/
+uint32_t getLastDeltaWords(void);
+
+/*****************************************************************************
+ *
+ * Pack the modulation matrix built by populateModulationMatrix() and commit
+ * it with commitPatternDoubleBuffered().
+ *
+ * Returns 0 on success, -1 on timeout.
+ *
+ ****************************************************************************/
+int commitModulationDoubleBuffered(void);
+
+/*****************************************************************************
+ *
+ * Packed pattern for a diagnostic preset, the same pattern
+ * populateModulationMatrix() gives for "all off", "all on" or
+ * "checkerboard", built on first use and kept.
+ *
+ * Returns a pointer to BUF_SIZE words, NULL if the preset is not known.
+ *
+ ****************************************************************************/
+const uint32_t* getPresetPattern(patternPreset preset);
+
+/*****************************************************************************
+ *
+ * Commit a diagnostic preset with commitPatternDoubleBuffered().
+ *
+ * Returns 0 on success, -1 on timeout or if the preset is not known.
+ *
+ ****************************************************************************/
+int commitPresetPattern(patternPreset preset);
+
+/*****************************************************************************
+ *
+ * Pack a compact cell bitmap straight into the pattern buffer layout,
+ * without going through the 160 x 160 modulation matrix.
+ *
+ * argument1:	CELL_BITMAP_BYTES bytes, bit n counted LSB first from byte 0
+ * 				is active cell n in kdkRowBitMask / kdkColumnBitMask order
+ * argument2:	caller buffer of BUF_SIZE words, receives the packed pattern
+ *
+ ****************************************************************************/
+void packCellBitmap(const uint8_t* cellBitmap, uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * Pack a cell bitmap with packCellBitmap() and commit it with
+ * commitPatternDoubleBuffered().
+ *
+ * Returns 0 on success, -1 on timeout.
+ *
+ ****************************************************************************/
+int commitCellBitmap(const uint8_t* cellBitmap);
+
+/*****************************************************************************
+ *
+ * Decode a packed pattern, for example a copy of the pattern RAM, back into
+ * a cell bitmap laid out as for packCellBitmap().
+ *
+ * argument1:	BUF_SIZE words in the pattern buffer layout
+ * argument2:	caller buffer of CELL_BITMAP_BYTES, receives the bitmap
+ *
+ ****************************************************************************/
+void unpackCellBitmap(const uint32_t* packedPattern, uint8_t* cellBitmap);
+
+/*****************************************************************************
+ *
+ * Decode a packed pattern back into a modulation matrix, the layout built
+ * by populateModulationMatrix().
+ *
+ * argument1:	BUF_SIZE words in the pattern buffer layout
+ * argument2:	caller buffer of MAX_ROWS * MAX_COLS bytes, receives 1 for
+ * 				each cell that is on and 0 everywhere else
+ *
+ ****************************************************************************/
+void unpackModulationMatrix(const uint32_t* packedPattern, uint8_t* matrix);
+
+/*****************************************************************************
+ *
+ * Compare the live pattern RAM against the pattern that should be there,
+ * e.g. right after a commit in test mode.
+ *
+ * Returns the number of differing bits, 0 when the FPGA holds the pattern.
+ *
+ ****************************************************************************/
+uint32_t countPatternBitErrors(const uint32_t* expectedPattern);
+
+/*****************************************************************************
+*
+* function initCellGeometry()
+*
+* - compute the per-cell wave equation terms that do not depend on the
+*   steering angles (rho, incident wave, element rotation) and cache them
+* - called automatically by calcWaveModulation(), may be called at startup to
+*   keep the one time cost out of the first steering update
+* - returns:	none
+*
+*****************************************************************************/
+void initCellGeometry(void);
+
+/*****************************************************************************
+*
+* function setWaveModulationKernel()
+*
+* - select the kernel calcWaveModulation() uses for the per-cell work
+* - supported arguments when calling:	"double"	reference double
+* 											precision complex.h kernel
+* 											(default)
+* 										"float32"	single precision
+* 											polynomial sin/cos kernel, NEON
+* 											on the A9, bit identical scalar
+* 											fallback elsewhere
+* 										"fixed point"	32 bit phase
+* 											accumulator with a Q15 sine
+* 											table, integer only per cell
+* - returns:	0 on success, -1 if the kernel name is not recognized
+*
+*****************************************************************************/
+int setWaveModulationKernel(const char* kernelName);
+
+/*****************************************************************************
+*
+* function startWaveWorkers()
+*
+* - start a persistent pool of worker threads that split the per-cell wave
+*   calculations with the calling thread, 1 worker uses both A9 cores
+* - no threads are created or destroyed on the steering path afterwards
+* - arguments:	number of worker threads, 1 to 3
+* - returns:	0 on success, -1 on failure
+*
+*****************************************************************************/
+int startWaveWorkers(uint8_t numWorkers);
+
+/*****************************************************************************
+*
+* function stopWaveWorkers()
+*
+* - stop the worker pool started by startWaveWorkers()
+* - returns:	none
+*
+*****************************************************************************/
+void stopWaveWorkers(void);
+
 /*****************************************************************************
 *
 * function calcWaveModulation()
@@ -211,6 +659,183 @@ void calcWaveModulation(double theta, double phi, double phase);
  ****************************************************************************/
 void formatAndWriteModulationToFPGAKDKFromScratch(void);
 
+/*****************************************************************************
+ *
+ * Calculate the wave equation modulation for the steering angles and pack
+ * it straight into the pattern buffer layout, without going through the
+ * modulation matrices.
+ *
+ * argument1-3:	theta, phi and phase angles in degrees, as passed to
+ * 				calcWaveModulation()
+ * argument4:	caller buffer of BUF_SIZE words, receives the packed pattern
+ *
+ ****************************************************************************/
+void steerAndPack(double theta, double phi, double phase,
+		uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * Calculate and pack count patterns in one call, for scan tables and look
+ * ahead trajectories.
+ *
+ * argument1:	count (theta, phi, phase) triples in degrees, stored one
+ * 				after the other
+ * argument2:	number of triples
+ * argument3:	caller buffer of count * BUF_SIZE words, pattern n is written
+ * 				at packedPatterns + n * BUF_SIZE
+ *
+ ****************************************************************************/
+void steerAndPackBatch(const double* angles, uint32_t count,
+		uint32_t* packedPatterns);
+
+/*****************************************************************************
+ *
+ * Start an incremental raster or tracking sweep.  Phi and phase stay fixed
+ * and each step advances sin(theta) by a constant, which lets every step
+ * rotate the per-cell waves with one complex multiply instead of evaluating
+ * the trig again.
+ *
+ * argument1-3:	starting theta, phi and phase in degrees
+ * argument4:	sin(theta) increment per step
+ * argument5:	steps between exact recomputations of the per-cell waves,
+ * 				0 for the default of 64
+ *
+ * Returns 0 on success, -1 if theta is outside +/- 90 degrees.
+ *
+ ****************************************************************************/
+int beginWaveSweep(double theta, double phi, double phase,
+		double sinThetaStep, uint16_t reseedInterval);
+
+/*****************************************************************************
+ *
+ * Pack the pattern of the current sweep step, same layout as
+ * steerAndPack(), and advance the sweep by one step.
+ *
+ * Returns 0 on success, -1 if no sweep is active or the sweep has stepped
+ * past sin(theta) = +/- 1.
+ *
+ ****************************************************************************/
+int nextWaveSweepPattern(uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * Fast polarization update.  Every pointing keeps its per-cell waves, so a
+ * new phase and linear polarization angle is a linear combination of the
+ * stored theta and phi components, without the geometry or steering trig.
+ * The wave modulation matrix is updated as by calcWaveModulation().
+ *
+ * Only the last pattern calculated by the wave kernels can be recombined,
+ * from calcWaveModulation(), steerAndPack(), a steerAndPackCached() miss or
+ * nextWaveSweepPattern().  A steerAndPackCached() hit or a
+ * lookupBeamCodebook() call leaves no pointing to recombine.
+ *
+ * argument1:	phase angle in degrees
+ * argument2:	linear polarization angle in degrees, also used by later
+ * 				pointings and the remaining steps of an active sweep
+ *
+ * Returns 0 on success, -1 if there is no pointing to recombine.
+ *
+ ****************************************************************************/
+int setPolarization(double phase, double polAngle);
+
+/*****************************************************************************
+ *
+ * Same as setPolarization(), packs the result into packedPattern as
+ * steerAndPack() does instead of updating the modulation matrix.
+ *
+ ****************************************************************************/
+int setPolarizationAndPack(double phase, double polAngle,
+		uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * Size the packed pattern cache used by steerAndPackCached().
+ *
+ * argument1:	angle resolution of the cache keys in degrees, theta, phi
+ * 				and phase are rounded to multiples of it
+ * argument2:	memory budget in bytes, about 4.2 KB per cached pattern, 0
+ * 				disables the cache
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int configurePatternCache(double angleResolution, uint32_t memoryBudget);
+
+/*****************************************************************************
+ *
+ * steerAndPack() through an LRU cache of packed patterns, keyed on the
+ * angles quantized to the cache resolution.  A hit is a 4 KB copy with no
+ * wave calculation.  Changing the wave kernel or the polarization empties
+ * the cache.
+ *
+ * Returns 1 on a cache hit, 0 on a miss.
+ *
+ ****************************************************************************/
+int steerAndPackCached(double theta, double phi, double phase,
+		uint32_t* packedPattern);
+
+/*****************************************************************************
+ *
+ * Empty the pattern cache, keeps its size and counters.
+ *
+ ****************************************************************************/
+void clearPatternCache(void);
+
+/*****************************************************************************
+ *
+ * Read the pattern cache hit and miss counters, reset by
+ * configurePatternCache().
+ *
+ ****************************************************************************/
+void getPatternCacheStats(uint32_t* hits, uint32_t* misses);
+
+/*****************************************************************************
+ *
+ * Generate a beam codebook file, the packed pattern of every point of a
+ * theta, phi, phase grid, using the active wave kernel and polarization.
+ * Normally run off-target, see generateBeamCodebook.py.
+ *
+ * argument1:	path of the file to create
+ * argument2-4:	theta grid start, step in degrees and number of points
+ * argument5-7:	phi grid start, step and number of points
+ * argument8-10:	phase grid start, step and number of points
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int writeBeamCodebook(const char* filePath,
+		double thetaStart, double thetaStep, uint32_t numTheta,
+		double phiStart, double phiStep, uint32_t numPhi,
+		double phaseStart, double phaseStep, uint32_t numPhase);
+
+/*****************************************************************************
+ *
+ * Map a beam codebook file read only, replacing any open codebook.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int openBeamCodebook(const char* filePath);
+
+/*****************************************************************************
+ *
+ * Unmap the beam codebook opened by openBeamCodebook().
+ *
+ ****************************************************************************/
+void closeBeamCodebook(void);
+
+/*****************************************************************************
+ *
+ * Constant time lookup of the codebook pattern nearest to the steering
+ * angles in degrees.  Phi and phase wrap when their grid spans a full turn,
+ * other angles clamp to the grid.
+ *
+ * Returns a pointer to the BUF_SIZE packed words inside the mapping, NULL
+ * when no codebook is open.
+ *
+ ****************************************************************************/
+const uint32_t* lookupBeamCodebook(double theta, double phi, double phase);
+
 /*****************************************************************************
 *
 * function calcWaveModualtion()
@@ -226,4 +851,154 @@ void formatAndWriteModulationToFPGAKDKFromScratch(void);
 *****************************************************************************/
 void calcWaveModulation(double theta, double phi, double phase);
 
+/*****************************************************************************
+ *
+ * Open a pattern snapshot log for appending, creating it if needed.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int openSnapshotLog(const char* filePath);
+
+/*****************************************************************************
+ *
+ * Close the pattern snapshot log.
+ *
+ ****************************************************************************/
+void closeSnapshotLog(void);
+
+/*****************************************************************************
+ *
+ * Append a snapshot of a packed pattern to the open snapshot log, see
+ * patternSnapshotHeader.
+ *
+ * argument1:	BUF_SIZE packed words
+ * argument2:	theta, phi and phase the pattern was steered to, degrees
+ * argument5:	true to also record the real modulation per active cell from
+ * 				the last wave calculation
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int appendPatternSnapshot(const uint32_t* packedPattern, double theta,
+		double phi, double phase, bool includeModulation);
+
+/*****************************************************************************
+ *
+ * Map a pattern snapshot log for reading with nextPatternSnapshot().
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int openSnapshotReader(const char* filePath);
+
+/*****************************************************************************
+ *
+ * Iterate the mapped snapshot log without copying.
+ *
+ * Returns a pointer to the next header inside the mapping, NULL at the end
+ * of the log or at a damaged record.
+ *
+ ****************************************************************************/
+const patternSnapshotHeader* nextPatternSnapshot(void);
+
+/*****************************************************************************
+ *
+ * Pattern words of a snapshot, patternWords of them.
+ *
+ ****************************************************************************/
+const uint32_t* getSnapshotPattern(const patternSnapshotHeader* header);
+
+/*****************************************************************************
+ *
+ * Modulation vector of a snapshot, modulationCells floats, NULL when it was
+ * not recorded.
+ *
+ ****************************************************************************/
+const float* getSnapshotModulation(const patternSnapshotHeader* header);
+
+/*****************************************************************************
+ *
+ * Unmap the snapshot log being read.
+ *
+ ****************************************************************************/
+void closeSnapshotReader(void);
+
+/*****************************************************************************
+ *
+ * Start the background pattern recorder.  Snapshots queued with
+ * recordPatternSnapshot() go into a lock free ring and a low priority
+ * thread appends them to the snapshot log in large sequential writes.
+ *
+ * argument1:	snapshot log to append to, see patternSnapshotHeader
+ * argument2:	ring capacity in snapshots, rounded up to a power of 2, 0 for
+ * 				the default of 256
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ ****************************************************************************/
+int startPatternRecorder(const char* filePath, uint32_t ringSlots);
+
+/*****************************************************************************
+ *
+ * Queue a snapshot of a packed pattern for the recorder, without the
+ * modulation vector.  Never blocks, a snapshot that does not fit in the
+ * ring is dropped and counted.  Call from one thread only.  The bank and
+ * timestamp are those latched by the last pattern Ram write, 0 when nothing
+ * was written yet, and the polarization is the current one, so queueing
+ * reads no registers and no clock.
+ *
+ * Returns 0 when queued, -1 when dropped or the recorder is not running.
+ *
+ ****************************************************************************/
+int recordPatternSnapshot(const uint32_t* packedPattern, double theta,
+		double phi, double phase);
+
+/*****************************************************************************
+ *
+ * Write out the queued snapshots and stop the recorder thread.
+ *
+ ****************************************************************************/
+void stopPatternRecorder(void);
+
+/*****************************************************************************
+ *
+ * Snapshots written by the recorder and snapshots dropped because the ring
+ * was full, since startPatternRecorder().
+ *
+ ****************************************************************************/
+void getPatternRecorderStats(uint32_t* recorded, uint32_t* overruns);
+
+/*****************************************************************************
+ *
+ * Select the clock that times each update stage, see latencyStage.
+ *
+ * argument1:	"off" (the default), "monotonic" or "cycle counter", the
+ * 				Cortex-A9 PMU cycle counter, which the kernel must have
+ * 				enabled for user space
+ * argument2:	CPU clock in MHz, converts cycles to nanoseconds
+ *
+ * Returns 0 on success, -1 if the clock is not recognized or not
+ * available, the timing is then off.
+ *
+ ****************************************************************************/
+int setStageTiming(const char* clockName, uint32_t cpuMHz);
+
+/*****************************************************************************
+ *
+ * Latency of one update stage: sample count, min, mean and max since the
+ * last reset, 99th percentile over the latest 1024 samples, nanoseconds.
+ *
+ * Returns 0 on success, -1 if the stage is not known.
+ *
+ ****************************************************************************/
+int getStageStats(latencyStage stage, stageLatencyStats* stats);
+
+/*****************************************************************************
+ *
+ * Clear the latency statistics of every stage.
+ *
+ ****************************************************************************/
+void resetStageStats(void);
+
 #endif